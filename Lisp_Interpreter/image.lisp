@@ -0,0 +1,8 @@
+(define fact (n) (if (= n 0) 1 (* n (fact (- n 1)))))
+(set inc (lambda (x) (+ x 1)))
+(set mfact (memoize fact))
+(set data '(1 -2.5 "three" (four . 4)))
+(set big 9223372036854775807)
+(set v (list->vec '(1 2 3)))
+(set tb (make-hash))
+(hash-set! tb "key" 'value)
@@ -1,10 +1,42 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <cmath>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <dlfcn.h>
+#include <fcntl.h>
 #include <fstream>
+#include <functional>
+#include <iomanip>
 #include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <netinet/in.h>
+#include <new>
 #include <sstream>
+#include <stdexcept>
 #include <string>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
 #include <unordered_map>
 #include <vector>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 namespace {
 
@@ -29,8 +61,9 @@ private:
 enum class TokenKind {
         BeginParenthesis,
         EndParenthesis,
+        Integer,
         Nil,
-        Num,
+        Real,
         String,
         Symbol,
         Quote,
@@ -44,6 +77,10 @@ struct LispToken {
 
 enum class ExprKind {
         Function,
+        Local,
+        Future,
+        Hash,
+        Memo,
         Num,
         Nil,
         Pair,
@@ -51,100 +88,355 @@ enum class ExprKind {
         String,
         Symbol,
         True,
+        Vector,
+};
+
+const size_t kNumKinds = static_cast<size_t>(ExprKind::Vector) + 1;
+
+// In the order of ExprKind.
+const char *const kKindNames[kNumKinds] = {
+        "FUNCTION", "LOCAL", "FUTURE", "HASH", "MEMO", "NUMBER", "NIL",
+        "PAIR", "PRIMITIVE", "STRING", "SYMBOL", "T", "VECTOR",
+};
+
+class HashCons;
+class Heap;
+class LispExprInterface;
+class PairExpr;
+class SymbolExpr;
+class Vm;
+
+// A Lisp value fits in a machine word.  Fixnums, NIL, T and symbols are
+// immediates that need neither an allocation nor a virtual call to be
+// inspected, any other value points to an expression living in the heap.
+// The tag in the low bits tells them apart: the heap objects and the
+// symbols are at least 8 bytes aligned, and a fixnum keeps its integer in
+// the upper 61 bits of the word.
+class Value {
+public:
+        constexpr Value() : bits_(kNilBits) {}
+        Value(const LispExprInterface *e) :
+                bits_(reinterpret_cast<uintptr_t>(e))
+        {}
+
+        static constexpr Value Nil() { return (Value(kNilBits, 0)); }
+        static constexpr Value True() { return (Value(kTrueBits, 0)); }
+
+        static const int64_t kMinFixnum = -(INT64_C(1) << 60);
+        static const int64_t kMaxFixnum = (INT64_C(1) << 60) - 1;
+
+        static bool FitsFixnum(int64_t n)
+        {
+                return (n >= kMinFixnum && n <= kMaxFixnum);
+        }
+
+        static Value Fixnum(int64_t n)
+        {
+                return (Value(static_cast<uint64_t>(n) << 3 | kFixnumTag, 0));
+        }
+
+        static Value Symbol(const SymbolExpr *s)
+        {
+                return (Value(reinterpret_cast<uintptr_t>(s) | kSymbolTag, 0));
+        }
+
+        bool IsObject() const { return ((bits_ & kTagMask) == kObjectTag); }
+        bool IsFixnum() const { return ((bits_ & kTagMask) == kFixnumTag); }
+        bool IsSymbol() const { return ((bits_ & kTagMask) == kSymbolTag); }
+        bool IsNil() const { return (bits_ == kNilBits); }
+
+        ExprKind Type() const;
+        string ToString() const;
+
+        const LispExprInterface *AsObject() const
+        {
+                return (reinterpret_cast<const LispExprInterface *>(bits_));
+        }
+
+        const PairExpr *AsPair() const;
+
+        const SymbolExpr *AsSymbol() const
+        {
+                return (reinterpret_cast<const SymbolExpr *>(
+                                bits_ & ~kTagMask));
+        }
+
+        int64_t AsFixnum() const
+        {
+                return (static_cast<int64_t>(bits_) >> 3);
+        }
+
+        // Identity, as in EQ?.
+        bool operator==(const Value& v) const { return (bits_ == v.bits_); }
+        bool operator!=(const Value& v) const { return (bits_ != v.bits_); }
+
+        // The word itself, as the code compiled ahead of time handles it.
+        uint64_t Bits() const { return (bits_); }
+        static Value FromBits(uint64_t bits) { return (Value(bits, 0)); }
+
+        static const uint64_t kTagMask          = 7;
+        static const uint64_t kFixnumTag        = 1;
+private:
+        static const uint64_t kObjectTag        = 0;
+        static const uint64_t kSymbolTag        = 2;
+        static const uint64_t kConstTag         = 3;
+        static const uint64_t kNilBits          = 0 << 3 | kConstTag;
+        static const uint64_t kTrueBits         = 1 << 3 | kConstTag;
+
+        constexpr Value(uint64_t bits, int) : bits_(bits) {}
+
+        uint64_t bits_;
 };
 
+const Value kNil = Value::Nil();
+const Value kTrue = Value::True();
+
 class LispExprInterface {
 public:
+        virtual ~LispExprInterface() {}
+
         virtual ExprKind Type() const = 0;
         virtual string ToString() const = 0;
+
+        // Marks every expression directly reachable from this one.
+        virtual void Trace(Heap&) const {}
+
+        // Expressions live in the garbage collected heap.  They are never
+        // deleted explicitly, the collector reclaims them once unreachable.
+        static void *operator new(size_t size);
+        static void operator delete(void *p);
 };
 
-class NumExpr : public LispExprInterface {
-public:
-        explicit NumExpr(float val): val_(val) {}
+// FNV-1a, over the characters of a string.
+size_t HashChars(const char *s, size_t size)
+{
+        uint64_t h = UINT64_C(0xcbf29ce484222325);
 
-        virtual ExprKind Type() const { return ExprKind::Num; }
+        for (size_t i = 0; i < size; i++)
+                h = (h ^ static_cast<unsigned char>(s[i])) *
+                        UINT64_C(0x100000001b3);
+        return (h);
+}
 
-        virtual string ToString() const
-        {
-                std::ostringstream ss;
-                ss << val_;
+// The characters of strings.  A buffer is shared by a string and the ones
+// cut from it or appended to it.  Characters are only ever added after the
+// ones used, which no string sees, so strings read theirs without a lock.
+class StrBuf {
+public:
+        explicit StrBuf(StrBuf const&)          = delete;
+        void operator=(StrBuf const&)           = delete;
 
-                return (ss.str());
+        // Holds the size characters of s, with room for capacity in all.
+        explicit StrBuf(const char *s, size_t size, size_t capacity) :
+                data_(new char[capacity]), capacity_(capacity), used_(size)
+        {
+                std::memcpy(data_.get(), s, size);
         }
 
-        const float& Val() const { return val_; }
+        const char *Data() const { return (data_.get()); }
+
+        // Where to write size more characters, unless those used don't end
+        // at end or there is no room for them.
+        char *Claim(size_t end, size_t size)
+        {
+                if (size > capacity_ - end ||
+                    !used_.compare_exchange_strong(end, end + size))
+                        return (NULL);
+                return (data_.get() + end);
+        }
 private:
-        const float val_;
+        const std::unique_ptr<char[]> data_;
+        const size_t capacity_;
+        std::atomic<size_t> used_;
 };
 
+// A string is a view of the characters of a buffer.
 class StrExpr : public LispExprInterface {
 public:
-        explicit StrExpr(const string& s): s_(s) {}
+        explicit StrExpr(const string& s) :
+                buf_(std::make_shared<StrBuf>(s.data(), s.size(), s.size())),
+                offset_(0), size_(s.size())
+        {}
+
+        explicit StrExpr(const std::shared_ptr<StrBuf>& buf, size_t offset,
+                         size_t size) :
+                buf_(buf), offset_(offset), size_(size)
+        {}
 
         virtual ExprKind Type() const { return ExprKind::String; }
 
         virtual string ToString() const
         {
-                std::ostringstream ss;
-                ss << '"' << s_ << '"';
+                string s;
 
-                return (ss.str());
+                s.reserve(size_ + 2);
+                s += '"';
+                s.append(Data(), size_);
+                s += '"';
+                return (s);
+        }
+
+        const char *Data() const { return (buf_->Data() + offset_); }
+        size_t Size() const { return (size_); }
+        string Str() const { return (string(Data(), size_)); }
+
+        const std::shared_ptr<StrBuf>& buf() const { return (buf_); }
+
+        // The characters from begin to end, not copied.
+        StrExpr *Slice(size_t begin, size_t end) const
+        {
+
+                return (new StrExpr(buf_, offset_ + begin, end - begin));
         }
 
+        StrExpr *Append(const vector<const StrExpr *>& parts) const;
 private:
-        const string s_;
+        const std::shared_ptr<StrBuf> buf_;
+        const size_t offset_;
+        const size_t size_;
 };
 
-class NilExpr : public LispExprInterface {
+// This string followed by parts.  They are written in the room left in the
+// buffer if this string ends where its used characters do, in a new buffer
+// twice as large as needed otherwise: a string appended to again and again
+// is only copied a logarithmic number of times.
+StrExpr *StrExpr::Append(const vector<const StrExpr *>& parts) const
+{
+        size_t size = size_;
+
+        for (auto p: parts)
+                size += p->size_;
+
+        auto buf = buf_;
+        size_t offset = offset_;
+        char *out = buf->Claim(offset_ + size_, size - size_);
+        if (out == NULL) {
+                buf = std::make_shared<StrBuf>(Data(), size_,
+                                               std::max<size_t>(2 * size,
+                                                                16));
+                offset = 0;
+                out = buf->Claim(size_, size - size_);
+        }
+        for (auto p: parts) {
+                std::memcpy(out, p->Data(), p->size_);
+                out += p->size_;
+        }
+
+        return (new StrExpr(buf, offset, size));
+}
+
+// A number that is not a fixnum: an integer too large for the immediate
+// representation or a double precision real.
+class NumExpr : public LispExprInterface {
 public:
-        explicit NilExpr(NilExpr const&)        = delete;
-        void operator=(NilExpr const&)          = delete;
+        explicit NumExpr(int64_t i) : exact_(true), i_(i), d_(0) {}
+        explicit NumExpr(double d) : exact_(false), i_(0), d_(d) {}
+
+        virtual ExprKind Type() const { return ExprKind::Num; }
 
-        static NilExpr& GetInstance()
+        virtual string ToString() const
         {
-                static NilExpr instance;
+                std::ostringstream ss;
 
-                return (instance);
-        }
+                if (exact_)
+                        ss << i_;
+                else
+                        ss << std::setprecision(15) << d_;
 
-        virtual ExprKind Type() const { return ExprKind::Nil; }
+                return (ss.str());
+        }
 
-        virtual string ToString() const { return "()"; }
+        bool IsExact() const { return (exact_); }
+        int64_t Int() const { return (i_); }
+        double Real() const { return (d_); }
 private:
-        explicit NilExpr() {}
+        const bool exact_;
+        const int64_t i_;
+        const double d_;
 };
 
-class TrueExpr : public LispExprInterface {
+// A vector of reals, for the primitives that work on all of its elements at
+// once.  The elements are stored contiguously in the object itself, after
+// its fields.  Like a pair, a vector is never modified once built.
+class VecExpr : public LispExprInterface {
 public:
-        explicit TrueExpr(TrueExpr const&)      = delete;
-        void operator=(TrueExpr const&)         = delete;
+        // Allocates a vector of n elements, to be set by the caller.
+        static VecExpr *Make(size_t n);
 
-        static TrueExpr& GetInstance()
+        virtual ExprKind Type() const { return ExprKind::Vector; }
+
+        virtual string ToString() const
         {
-                static TrueExpr instance;
+                std::ostringstream ss;
+
+                ss << "#(" << std::setprecision(15);
+                for (size_t i = 0; i < size_; i++)
+                        ss << (i ? " " : "") << Data()[i];
+                ss << ')';
 
-                return (instance);
+                return (ss.str());
         }
 
-        virtual ExprKind Type() const { return ExprKind::True; }
+        size_t Size() const { return (size_); }
 
-        virtual string ToString() const { return "T"; }
+        const double *Data() const
+        {
+                return (reinterpret_cast<const double *>(this + 1));
+        }
+
+        double *Data() { return (reinterpret_cast<double *>(this + 1)); }
 private:
-        explicit TrueExpr() {}
+        explicit VecExpr(size_t n) : size_(n) {}
+
+        const size_t size_;
 };
 
-const NilExpr *kNil = &NilExpr::GetInstance();
-const TrueExpr *kTrue = &TrueExpr::GetInstance();
+// The forms evaluated by EvalList itself rather than applied.  Their symbols
+// carry the tag, so that telling them apart from a call costs one switch.
+enum class SpecialForm {
+        None,
+        Apply,
+        Cond,
+        Define,
+        Eval,
+        If,
+        Lambda,
+        Profile,
+        Quote,
+        Set,
+        Time,
+};
+
+const struct {
+        const char *name;
+        SpecialForm form;
+} kSpecialForms[] = {
+        {"APPLY",       SpecialForm::Apply},
+        {"COND",        SpecialForm::Cond},
+        {"DEFINE",      SpecialForm::Define},
+        {"EVAL",        SpecialForm::Eval},
+        {"IF",          SpecialForm::If},
+        {"LAMBDA",      SpecialForm::Lambda},
+        {"PROFILE",     SpecialForm::Profile},
+        {"QUOTE",       SpecialForm::Quote},
+        {"SET",         SpecialForm::Set},
+        {"TIME",        SpecialForm::Time},
+};
 
-class SymbolExpr : public LispExprInterface {
+// Symbols are interned for the life of the process, outside of the heap,
+// and shared by all the interpreters.  Each thread looks them up in a cache
+// of its own first, and only takes the lock of the table to intern one it
+// hasn't seen.
+class SymbolExpr {
 public:
         explicit SymbolExpr(SymbolExpr const&)  = delete;
         void operator=(SymbolExpr const&)       = delete;
 
         static const SymbolExpr *GetInstance(const string& sym)
         {
-                static unordered_map<string, const SymbolExpr *> m_;
+                auto& table = Table();
+                static thread_local unordered_map<string,
+                                                  const SymbolExpr *> seen;
                 const SymbolExpr *symp;
                 string s;
 
@@ -152,800 +444,6201 @@ public:
                 for (auto c : sym)
                         s += toupper(c);
 
-                auto search = m_.find(s);
+                auto cached = seen.find(s);
+                if (cached != seen.end())
+                        return (cached->second);
 
-                if (search != m_.end())
-                        return (search->second);
+                std::lock_guard<std::mutex> guard(table.lock);
+                auto search = table.names.find(s);
 
-                symp = new SymbolExpr(s);
-                m_[symp->s_] = symp;
+                if (search != table.names.end())
+                        symp = search->second;
+                else {
+                        symp = new SymbolExpr(s, table.ids.size());
+                        table.names[symp->s_] = symp;
+                        table.ids.push_back(symp);
+                }
+                seen[symp->s_] = symp;
 
                 return (symp);
         }
 
-        virtual ExprKind Type() const { return ExprKind::Symbol; }
+        // The symbol numbered id.
+        static const SymbolExpr *FromId(size_t id)
+        {
+                auto& table = Table();
+                std::lock_guard<std::mutex> guard(table.lock);
+
+                return (table.ids[id]);
+        }
+
+        // The number of symbols interned so far.
+        static size_t Count()
+        {
+                auto& table = Table();
+                std::lock_guard<std::mutex> guard(table.lock);
+
+                return (table.ids.size());
+        }
+
+        string ToString() const { return s_; }
 
-        virtual string ToString() const { return s_; }
+        SpecialForm Special() const { return (special_); }
 
-        bool IsEqual(const string& s) const { return (s == s_); }
+        // The symbols are numbered densely in the order they are interned.
+        size_t Id() const { return (id_); }
 private:
-        explicit SymbolExpr(const string& s) : s_(s) {}
+        struct Interned {
+                unordered_map<string, const SymbolExpr *> names;
+                vector<const SymbolExpr *> ids;
+                std::mutex lock;
+        };
+
+        static Interned& Table()
+        {
+                static Interned table;
+
+                return (table);
+        }
+
+        explicit SymbolExpr(const string& s, size_t id) :
+                s_(s), special_(SpecialForm::None), id_(id)
+        {
+                for (auto& f: kSpecialForms)
+                        if (s_ == f.name)
+                                special_ = f.form;
+        }
 
         const string s_;
+        SpecialForm special_;
+        const size_t id_;
 };
 
+ExprKind Value::Type() const
+{
+
+        switch (bits_ & kTagMask) {
+        case kObjectTag:
+                return (AsObject()->Type());
+        case kFixnumTag:
+                return (ExprKind::Num);
+        case kSymbolTag:
+                return (ExprKind::Symbol);
+        default:
+                return (bits_ == kTrueBits ? ExprKind::True : ExprKind::Nil);
+        }
+}
+
+string Value::ToString() const
+{
+        std::ostringstream ss;
+
+        switch (bits_ & kTagMask) {
+        case kObjectTag:
+                return (AsObject()->ToString());
+        case kFixnumTag:
+                ss << AsFixnum();
+                return (ss.str());
+        case kSymbolTag:
+                return (AsSymbol()->ToString());
+        default:
+                return (bits_ == kTrueBits ? "T" : "()");
+        }
+}
+
 class PairExpr : public LispExprInterface {
 public:
-        explicit PairExpr(const LispExprInterface *first,
-                          const LispExprInterface *second) :
+        explicit PairExpr(Value first, Value second) :
                 first_(first), second_(second)
         {}
 
-        const LispExprInterface *First() const { return first_; }
-        const LispExprInterface *Second() const { return second_; }
+        Value First() const { return first_; }
+        Value Second() const { return second_; }
 
         virtual ExprKind Type() const { return ExprKind::Pair; }
 
-        virtual string ToString() const {
-                std::ostringstream ss;
-                const PairExpr *p = this;
+        virtual void Trace(Heap& heap) const;
+
+        virtual string ToString() const;
+private:
+        const Value first_;
+        const Value second_;
+};
+
+const PairExpr *Value::AsPair() const
+{
+
+        return (static_cast<const PairExpr *>(AsObject()));
+}
+
+// Lists nested in lists are printed without recursing, however deep.
+string PairExpr::ToString() const
+{
+        std::ostringstream ss;
+        // The rests of the lists being printed, the innermost last.
+        vector<Value> rests;
+        Value e = this;
+
+        for (;;) {
+                if (e.Type() == ExprKind::Pair) {
+                        ss << '(';
+                        rests.push_back(e.AsPair()->second_);
+                        e = e.AsPair()->first_;
+                        continue;
+                }
+                ss << e.ToString();
 
-                ss << '(';
                 for (;;) {
-                        ss << p->first_->ToString();
-                        if (p->second_->Type() == ExprKind::Pair) {
+                        if (rests.empty())
+                                return (ss.str());
+                        auto rest = rests.back();
+                        if (rest.Type() == ExprKind::Pair) {
                                 ss << ' ';
-                                p = static_cast<const PairExpr *>(p->second_);
-                        } else {
-                                if (p->second_->Type() != ExprKind::Nil)
-                                        ss << " . " << p->second_->ToString();
+                                rests.back() = rest.AsPair()->second_;
+                                e = rest.AsPair()->first_;
                                 break;
                         }
+                        if (!rest.IsNil())
+                                ss << " . " << rest.ToString();
+                        ss << ')';
+                        rests.pop_back();
                 }
+        }
+}
 
-                ss << ')';
+typedef Value (PrimFun) (vector<Value>&);
+// A function compiled ahead of time, see Translate().  It gets the words of
+// its arguments.
+typedef uint64_t (NativeFun) (const uint64_t *args, size_t n);
+
+static_assert(sizeof(Value) == sizeof(uint64_t), "Value is not a word");
+
+// How the code compiled ahead of time reaches back into the interpreter.
+// The text of the definition is copied as is into the generated code.
+#define YISP_API                                                        \
+struct YispApi {                                                        \
+        uint64_t (*call)(uint64_t fn, const uint64_t *args, size_t n);  \
+        uint64_t (*read)(const char *text);                             \
+        uint64_t (*global)(const char *name);                           \
+        void (*define)(const char *name,                                \
+                       uint64_t (*fn)(const uint64_t *, size_t));       \
+        void (*error)(const char *what);                                \
+}
+#define YISP_STRING(...) #__VA_ARGS__
+#define YISP_EXPAND_STRING(...) YISP_STRING(__VA_ARGS__)
+
+YISP_API;
+const char kApiSource[] = YISP_EXPAND_STRING(YISP_API);
+
+// The code generated by Translate() gets these helpers: the arithmetic and
+// the comparisons of two fixnums are done inline, anything else is left to
+// the primitive fn.
+const char kNativeRuntime[] = R"(
+inline bool
+Fixnums(uint64_t a, uint64_t b)
+{
+        return ((a & kTagMask) == kFixnumTag && (b & kTagMask) == kFixnumTag);
+}
 
-                return (ss.str());
+inline uint64_t
+Fixnum(int64_t n)
+{
+        return (static_cast<uint64_t>(n) << 3 | kFixnumTag);
+}
+
+inline int64_t
+Int(uint64_t a)
+{
+        return (static_cast<int64_t>(a) >> 3);
+}
+
+inline uint64_t
+Call(uint64_t fn, uint64_t a, uint64_t b)
+{
+        uint64_t args[] = {a, b};
+        return (api->call(fn, args, 2));
+}
+
+inline uint64_t
+Add(uint64_t fn, uint64_t a, uint64_t b)
+{
+        if (Fixnums(a, b)) {
+                int64_t n = Int(a) + Int(b);
+                if (n >= kMinFixnum && n <= kMaxFixnum)
+                        return (Fixnum(n));
         }
-private:
-        const LispExprInterface *first_;
-        const LispExprInterface *second_;
-};
+        return (Call(fn, a, b));
+}
+
+inline uint64_t
+Sub(uint64_t fn, uint64_t a, uint64_t b)
+{
+        if (Fixnums(a, b)) {
+                int64_t n = Int(a) - Int(b);
+                if (n >= kMinFixnum && n <= kMaxFixnum)
+                        return (Fixnum(n));
+        }
+        return (Call(fn, a, b));
+}
+
+inline uint64_t
+Less(uint64_t fn, uint64_t a, uint64_t b)
+{
+        if (Fixnums(a, b))
+                return (Int(a) < Int(b) ? kTrue : kNil);
+        return (Call(fn, a, b));
+}
+
+inline uint64_t
+Greater(uint64_t fn, uint64_t a, uint64_t b)
+{
+        if (Fixnums(a, b))
+                return (Int(a) > Int(b) ? kTrue : kNil);
+        return (Call(fn, a, b));
+}
 
-typedef const LispExprInterface *(PrimFun) (vector<const LispExprInterface *>&);
+inline uint64_t
+NumEq(uint64_t fn, uint64_t a, uint64_t b)
+{
+        if (Fixnums(a, b))
+                return (a == b ? kTrue : kNil);
+        return (Call(fn, a, b));
+}
+
+)";
 
 class PrimExpr : public LispExprInterface {
 public:
         explicit PrimExpr(const PrimFun* fn, const string& name) :
-                fn_(fn), name_(name) {}
+                fn_(fn), native_(NULL), name_(name) {}
+
+        explicit PrimExpr(const NativeFun* fn, const string& name) :
+                fn_(NULL), native_(fn), name_(name) {}
 
         virtual ExprKind Type() const { return ExprKind::Primitive; }
 
         virtual string ToString() const { return name_; }
 
-        const PrimFun* Impl() const { return (fn_); }
+        // Whether it was compiled ahead of time.
+        bool native() const { return (native_ != NULL); }
+
+        Value Call(vector<Value>& args) const
+        {
+
+                if (fn_ != NULL)
+                        return (fn_(args));
+                return (Value::FromBits(native_(
+                        reinterpret_cast<const uint64_t *>(args.data()),
+                        args.size())));
+        }
 private:
         const PrimFun* fn_;
+        const NativeFun* native_;
         const string name_;
 };
 
-class Env {
+// The global bindings of an interpreter: a cell per symbol, indexed by its
+// id.  The symbols are shared by all the interpreters, so the cells are not
+// kept on them.  A cell also counts the live frames binding its symbol: as
+// long as there is none, a reference to the symbol is a global one and
+// needs not look in the frames.
+class GlobalEnv {
 public:
-        explicit Env() : next_(NULL) {}
-        explicit Env(Env *next) : next_(next) {}
+        void define(const SymbolExpr *s, Value e)
+        {
+                auto& cell = Cell(s);
+
+                cell.value = e;
+                cell.bound = true;
+        }
 
-        void define(const SymbolExpr *s, const LispExprInterface *e)
+        // Returns NULL when the symbol is unbound.
+        const Value *lookup(const SymbolExpr *s) const
         {
-                table_[s] = e;
+                auto id = s->Id();
+
+                if (id < cells_.size() && cells_[id].bound)
+                        return (&cells_[id].value);
+                return (NULL);
         }
 
-        const LispExprInterface *lookup(const SymbolExpr *s)
+        // Whether a frame binds s.
+        bool shadowed(const SymbolExpr *s) const
         {
+                auto id = s->Id();
 
-                for (auto env = this; env; env = env->next_) {
-                        auto search = env->table_.find(s);
-                        if (search != env->table_.end())
-                                return (search->second);
-                }
+                return (id < cells_.size() && cells_[id].frames != 0);
+        }
 
-                return (NULL);
+        void bind(const SymbolExpr *s) { Cell(s).frames++; }
+
+        void unbind(const SymbolExpr *s) { cells_[s->Id()].frames--; }
+
+        // Calls f(s, value) for each bound symbol s.
+        template <typename F>
+        void ForEach(F f) const
+        {
+                for (size_t id = 0; id < cells_.size(); id++)
+                        if (cells_[id].bound)
+                                f(SymbolExpr::FromId(id), cells_[id].value);
         }
+
+        void Trace(Heap& heap) const;
 private:
-        unordered_map<const SymbolExpr *, const LispExprInterface *> table_;
-        Env *next_;
+        struct GlobalCell {
+                Value value;
+                bool bound;
+                size_t frames;
+        };
+
+        GlobalCell& Cell(const SymbolExpr *s)
+        {
+                auto id = s->Id();
+
+                if (id >= cells_.size())
+                        cells_.resize(id + 1, GlobalCell{kNil, false, 0});
+                return (cells_[id]);
+        }
+
+        vector<GlobalCell> cells_;
 };
 
-class FunExpr : public LispExprInterface {
+// A call frame binds the parameters of a function to its arguments:
+// parameter i is in slot i.  Variables are dynamically scoped, so a frame
+// points to the frame of its caller.
+class Env {
 public:
-        explicit FunExpr(vector<const SymbolExpr *>& params,
-                         const LispExprInterface *body,
-                         const SymbolExpr *name) :
-                params_(params), body_(body), name_(name)
-        {}
+        Env() : names_(NULL), slots_(NULL), size_(0), next_(NULL) {}
 
-        explicit FunExpr(vector<const SymbolExpr *>& params,
-                         const LispExprInterface *body) :
-                params_(params), body_(body), name_(NULL)
+        explicit Env(const vector<const SymbolExpr *>& names,
+                     const vector<Value>& args,
+                     const Env *next) :
+                names_(names.data()), slots_(args.data()),
+                size_(names.size()), next_(next)
         {}
 
-        virtual ExprKind Type() const { return ExprKind::Function; }
+        Value Slot(size_t i) const { return (slots_[i]); }
 
-        virtual string ToString() const
+        size_t Size() const { return (size_); }
+
+        const SymbolExpr *Name(size_t i) const { return (names_[i]); }
+
+        const Env *Next() const { return (next_); }
+
+        // Returns NULL when no frame binds the symbol.
+        const Value *lookup(const SymbolExpr *s) const
         {
-                std::ostringstream ss;
-                ss << "<procedure";
-                if (name_ != NULL) {
-                        ss << ':' << name_->ToString();
-                }
-                ss << '>';
 
-                return (ss.str());
+                for (auto env = this; env; env = env->next_)
+                        for (size_t i = 0; i < env->size_; i++)
+                                if (env->names_[i] == s)
+                                        return (&env->slots_[i]);
+
+                return (NULL);
         }
 
-        const vector<const SymbolExpr *>& params() const { return params_; }
-        const LispExprInterface *body() const { return body_; }
-        const SymbolExpr *name() const { return name_; }
+        // Marks the bindings of this frame only, the frames it points to are
+        // rooted on their own.
+        void Trace(Heap& heap) const;
 private:
-        const vector<const SymbolExpr *> params_;
-        const LispExprInterface *body_;
-        const SymbolExpr *name_;
+        const SymbolExpr *const *names_;
+        const Value *slots_;
+        size_t size_;
+        const Env *next_;
 };
 
-const void
-AssertArgsNum(const string& name,
-              vector<const LispExprInterface *>& args,
-              size_t n)
+// Counts the names bound by frame in the cells of globals, or stops
+// counting them.
+void BindFrame(GlobalEnv& globals, const Env& frame)
 {
-        if (args.size() == n)
-                return;
-        throw LispException(name + ": Wrong number of arguments.");
+        for (size_t i = 0; i < frame.Size(); i++)
+                globals.bind(frame.Name(i));
 }
 
-const NumExpr *NumCast(const LispExprInterface *e)
+void UnbindFrame(GlobalEnv& globals, const Env& frame)
 {
+        for (size_t i = 0; i < frame.Size(); i++)
+                globals.unbind(frame.Name(i));
+}
 
-        if (e->Type() != ExprKind::Num)
-                throw LispException("Not a number: " + e->ToString());
+// Unbinds the names of a frame, once bound, when it goes out of scope.
+class FrameGuard {
+public:
+        explicit FrameGuard(FrameGuard const&)  = delete;
+        void operator=(FrameGuard const&)       = delete;
 
-        return (static_cast<const NumExpr *>(e));
-}
+        explicit FrameGuard(GlobalEnv& globals) :
+                globals_(globals), frame_(NULL)
+        {}
 
-const SymbolExpr *SymbolCast(const LispExprInterface *e)
-{
+        ~FrameGuard()
+        {
+                if (frame_)
+                        UnbindFrame(globals_, *frame_);
+        }
 
-        if (e->Type() != ExprKind::Symbol)
-                throw LispException("Not a symbol: " + e->ToString());
+        void Bind(const Env *frame)
+        {
+                BindFrame(globals_, *frame);
+                frame_ = frame;
+        }
+private:
+        GlobalEnv& globals_;
+        const Env *frame_;
+};
 
-        return (static_cast<const SymbolExpr *>(e));
-}
+// A reference to a parameter of the function whose body contains it.  The
+// body of a function is compiled once, and every reference to one of its
+// parameters replaced by the slot where the frame holds it.
+class LocalRefExpr : public LispExprInterface {
+public:
+        explicit LocalRefExpr(size_t slot, const SymbolExpr *name) :
+                slot_(slot), name_(name)
+        {}
 
-const LispExprInterface *PrimPlus(vector<const LispExprInterface *>& args)
-{
-        float acc = 0;
+        virtual ExprKind Type() const { return ExprKind::Local; }
 
-        for (auto e: args)
-                acc += NumCast(e)->Val();
+        virtual string ToString() const { return (name_->ToString()); }
 
-        return (new NumExpr(acc));        
-}
+        size_t Slot() const { return (slot_); }
 
-const LispExprInterface *PrimMinus(vector<const LispExprInterface *>& args)
-{
-        float acc;
-        
-        if (args.size() == 0)
-                throw LispException("-: Expects at least one argument.");
+        const SymbolExpr *Name() const { return (name_); }
+private:
+        const size_t slot_;
+        const SymbolExpr *name_;
+};
 
-        acc = NumCast(args[0])->Val();        
-        if (args.size() == 1)
-                return (new NumExpr(-acc));
+// The instructions of the bytecode machine.  Each one is a word holding its
+// opcode in the low byte and its operand k above it.
+enum class Op : uint8_t {
+        Const,          // Push constant k.
+        Local,          // Push slot k of the frame.
+        Var,            // Push the variable named by constant k.
+        Set,            // Bind the global named by constant k to the top.
+        Jump,           // Continue at k.
+        JumpIfNil,      // Pop the top and continue at k if it is nil.
+        Call,           // Call the function below the k arguments on top.
+        TailCall,       // Same, in place of the running function.
+        Apply,          // Call the function below the list of arguments.
+        TailApply,      // Same, in place of the running function.
+        Eval,           // Replace the top by its value.
+        Tree,           // Push the value of constant k, as Evaluate() does.
+        Return,         // Return the top to the caller.
+};
 
-        for (size_t i = 1; i < args.size(); i++)
-                acc -= NumCast(args[i])->Val();
+// The bytecode of a function body or of a top level form.  Its constants
+// are parts of the expression it was compiled from.
+class Chunk {
+public:
+        static const size_t kMaxOperand = (1 << 24) - 1;
 
-        return (new NumExpr(acc));
-}
+        const uint32_t *Code() const { return (code_.data()); }
 
-const LispExprInterface *PrimMul(vector<const LispExprInterface *>& args)
-{
-        float acc = 1;
+        const Value *Consts() const { return (consts_.data()); }
 
-        for (auto e: args)
-                acc *= NumCast(e)->Val();
+        size_t Size() const { return (code_.size()); }
 
-        return (new NumExpr(acc));
-}
+        size_t AddConst(Value e)
+        {
 
-inline const float Div(const float& n, const float& d)
-{
+                consts_.push_back(e);
+                return (consts_.size() - 1);
+        }
 
-        if (d == 0.0)
-                throw LispException("/: Division by zero.");
-        return (n / d);        
-}
-
-const LispExprInterface *PrimDiv(vector<const LispExprInterface *>& args)
-{
-        float acc;
-        
-        if (args.size() == 0)
-                throw LispException("/: Expects at least one argument.");
+        // Returns the address of the instruction.
+        size_t Emit(Op op, size_t k = 0)
+        {
 
-        acc = NumCast(args[0])->Val();
-        if (args.size() == 1)
-                return (new NumExpr(Div(1, acc)));
+                if (k > kMaxOperand)
+                        throw LispException("Expression too large.");
+                code_.push_back(static_cast<uint32_t>(op) | k << 8);
+                return (code_.size() - 1);
+        }
 
-        for (size_t i = 1; i < args.size(); i++)
-                acc = Div(acc, NumCast(args[i])->Val());
+        // Sets the operand of the jump at the given address.
+        void Patch(size_t at, size_t k)
+        {
 
-        return (new NumExpr(acc));
-}
+                if (k > kMaxOperand)
+                        throw LispException("Expression too large.");
+                code_[at] = (code_[at] & 0xff) | k << 8;
+        }
+private:
+        vector<uint32_t> code_;
+        vector<Value> consts_;
+};
 
-const LispExprInterface *PrimCons(vector<const LispExprInterface *>& args)
-{
-        AssertArgsNum("CONS", args, 2);
-        return (new PairExpr(args[0], args[1]));
-}
+class FunExpr : public LispExprInterface {
+public:
+        explicit FunExpr(const vector<const SymbolExpr *>& params,
+                         Value body,
+                         Value code,
+                         const SymbolExpr *name) :
+                params_(params), body_(body), code_(code), name_(name),
+                chunk_(NULL)
+        {}
 
-const PairExpr *PairCast(const LispExprInterface *e)
-{
+        virtual ~FunExpr() { delete chunk_.load(); }
 
-        if (e->Type() != ExprKind::Pair)
-                throw LispException("Not a pair: " + e->ToString());
+        virtual ExprKind Type() const { return ExprKind::Function; }
 
-        return (static_cast<const PairExpr *>(e));
-}
+        virtual void Trace(Heap& heap) const;
 
-const LispExprInterface *PrimCar(vector<const LispExprInterface *>& args)
-{
-        AssertArgsNum("CAR", args, 1);
-        return (PairCast(args[0])->First());
-}
+        virtual string ToString() const
+        {
+                std::ostringstream ss;
+                ss << "<procedure";
+                if (name_ != NULL) {
+                        ss << ':' << name_->ToString();
+                }
+                ss << '>';
 
-const LispExprInterface *PrimCdr(vector<const LispExprInterface *>& args)
-{
-        AssertArgsNum("CDR", args, 1);
-        return (PairCast(args[0])->Second());
-}
+                return (ss.str());
+        }
 
-const LispExprInterface *
-IsType(const string& name,
-       vector<const LispExprInterface *>& args,
-       ExprKind kind)
-{
-        AssertArgsNum(name, args, 1);
-        if (args[0]->Type() == kind)
-                return (kTrue);
-        return (kNil);
-}
+        const vector<const SymbolExpr *>& params() const { return params_; }
+        Value body() const { return body_; }
+        // The body with its parameters resolved to slots.
+        Value code() const { return code_; }
+        const SymbolExpr *name() const { return name_; }
+        // The code compiled to bytecode, NULL until it is first run.
+        const Chunk *chunk() const { return chunk_.load(); }
 
-const LispExprInterface *PrimIsNum(vector<const LispExprInterface *>& args)
-{
+        // Threads running the function for the first time at once may all
+        // compile it: the first chunk set is kept, and returned.
+        const Chunk *set_chunk(const Chunk *chunk) const
+        {
+                const Chunk *none = NULL;
 
-        return (IsType("NUMBER?", args, ExprKind::Num));
-}
+                if (chunk_.compare_exchange_strong(none, chunk))
+                        return (chunk);
+                delete chunk;
+                return (none);
+        }
+private:
+        const vector<const SymbolExpr *> params_;
+        const Value body_;
+        const Value code_;
+        const SymbolExpr *name_;
+        mutable std::atomic<const Chunk *> chunk_;
+};
 
-const LispExprInterface *PrimIsSym(vector<const LispExprInterface *>& args)
+// Structural hashing and equality of values, as keys of a memo: numbers of
+// the same exactness and value, strings with the same characters and lists
+// of such values are the same, anything else is compared by identity.
+size_t HashValue(Value e)
 {
+        size_t h = 0;
 
-        return (IsType("SYMBOL?", args, ExprKind::Symbol));
+        for (;;) {
+                switch (e.Type()) {
+                case ExprKind::Num:
+                        if (e.IsFixnum())
+                                return (h * 31 + std::hash<uint64_t>()(
+                                                e.Bits()));
+                        {
+                                auto n = static_cast<const NumExpr *>(
+                                        e.AsObject());
+                                if (n->IsExact())
+                                        return (h * 31 +
+                                                std::hash<int64_t>()(n->Int()));
+                                return (h * 31 +
+                                        std::hash<double>()(n->Real()));
+                        }
+                case ExprKind::String: {
+                        auto s = static_cast<const StrExpr *>(e.AsObject());
+                        return (h * 31 + HashChars(s->Data(), s->Size()));
+                }
+                case ExprKind::Pair:
+                        h = h * 31 + HashValue(e.AsPair()->First());
+                        e = e.AsPair()->Second();
+                        break;
+                default:
+                        return (h * 31 + std::hash<uint64_t>()(e.Bits()));
+                }
+        }
 }
 
-const LispExprInterface *PrimIsList(vector<const LispExprInterface *>& args)
+bool SameValue(Value a, Value b)
 {
 
-        return (IsType("LIST?", args, ExprKind::Pair));
-}
-
-const LispExprInterface *PrimIsNil(vector<const LispExprInterface *>& args)
-{
+        for (;;) {
+                if (a == b)
+                        return (true);
+                if (!a.IsObject() || !b.IsObject() || a.Type() != b.Type())
+                        return (false);
 
-        return (IsType("NIL?", args, ExprKind::Nil));
+                switch (a.Type()) {
+                case ExprKind::Num: {
+                        auto m = static_cast<const NumExpr *>(a.AsObject());
+                        auto n = static_cast<const NumExpr *>(b.AsObject());
+                        if (m->IsExact() != n->IsExact())
+                                return (false);
+                        // The reals are compared bit for bit: 0.0 and -0.0
+                        // are different arguments.
+                        if (m->IsExact())
+                                return (m->Int() == n->Int());
+                        double x = m->Real(), y = n->Real();
+                        return (std::memcmp(&x, &y, sizeof(x)) == 0);
+                }
+                case ExprKind::String: {
+                        auto s = static_cast<const StrExpr *>(a.AsObject());
+                        auto t = static_cast<const StrExpr *>(b.AsObject());
+                        return (s->Size() == t->Size() &&
+                                std::memcmp(s->Data(), t->Data(),
+                                            s->Size()) == 0);
+                }
+                case ExprKind::Pair:
+                        if (!SameValue(a.AsPair()->First(),
+                                       b.AsPair()->First()))
+                                return (false);
+                        a = a.AsPair()->Second();
+                        b = b.AsPair()->Second();
+                        break;
+                default:
+                        return (false);
+                }
+        }
 }
 
-const LispExprInterface *PrimIsAnd(vector<const LispExprInterface *>& args)
-{
-        AssertArgsNum("AND?", args, 2);
-        if (args[0]->Type() != ExprKind::Nil &&
-            args[1]->Type() != ExprKind::Nil)
-                return (kTrue);
-        return (kNil);
-}
+// A procedure remembering what its function returned for the arguments it
+// was called with recently, see MEMOIZE.  Its cache holds at most capacity
+// entries and forgets the least recently used one first.
+class MemoExpr : public LispExprInterface {
+public:
+        explicit MemoExpr(Value fn, size_t capacity) :
+                fn_(fn), capacity_(capacity), hits_(0), misses_(0)
+        {}
 
-const LispExprInterface *PrimIsOr(vector<const LispExprInterface *>& args)
-{
-        AssertArgsNum("OR?", args, 2);
-        if (args[0]->Type() == ExprKind::Nil &&
-            args[1]->Type() == ExprKind::Nil)
-                return (kNil);
-        return (kTrue);
-}
+        virtual ExprKind Type() const { return ExprKind::Memo; }
 
-const LispExprInterface *PrimIsEq(vector<const LispExprInterface *>& args)
-{
-        AssertArgsNum("EQ?", args, 2);
+        virtual void Trace(Heap& heap) const;
 
-        if (args[0]->Type() == args[1]->Type() &&
-            ((args[0]->Type() == ExprKind::Num &&
-              NumCast(args[0])->Val() == NumCast(args[1])->Val()) ||
-             args[0] == args[1]))
-                return (kTrue);
-        return (kNil);
-}
+        virtual string ToString() const
+        {
 
-const LispExprInterface *PrimIsEqNum(vector<const LispExprInterface *>& args)
-{
-        AssertArgsNum("=", args, 2);
+                return ("<memo:" + fn_.ToString() + '>');
+        }
 
-        if (NumCast(args[0])->Val() == NumCast(args[1])->Val())
-                return (kTrue);
-        return (kNil);
-}
+        Value fn() const { return (fn_); }
 
-const LispExprInterface *PrimIsLtNum(vector<const LispExprInterface *>& args)
-{
-        AssertArgsNum("<", args, 2);
+        size_t capacity() const { return (capacity_); }
 
-        if (NumCast(args[0])->Val() < NumCast(args[1])->Val())
-                return (kTrue);
-        return (kNil);
-}
+        // Sets e to the value remembered for args, unless they were not
+        // seen recently.  Counts a hit or a miss.
+        bool Find(const vector<Value>& args, Value& e) const
+        {
+                std::lock_guard<std::mutex> guard(lock_);
+                auto search = index_.find(&args);
 
-const LispExprInterface *PrimIsGtNum(vector<const LispExprInterface *>& args)
-{
-        AssertArgsNum(">", args, 2);
+                if (search == index_.end()) {
+                        misses_++;
+                        return (false);
+                }
+                hits_++;
+                entries_.splice(entries_.begin(), entries_, search->second);
+                e = search->second->second;
+                return (true);
+        }
 
-        if (NumCast(args[0])->Val() > NumCast(args[1])->Val())
-                return (kTrue);
-        return (kNil);
-}
+        void Store(const vector<Value>& args, Value e) const;
 
-class SimpleLispInterpreter {
-public:
-        explicit SimpleLispInterpreter()
+        // The counters, as (hits misses size capacity).
+        vector<size_t> Stats() const
         {
-                InitGlobalEnv();
-        }
+                std::lock_guard<std::mutex> guard(lock_);
 
-        void Process(const string &inputStr)
-        {
-                vector<const LispExprInterface *> exprs;
-                auto tokens = GenerateTokens(inputStr);
-                size_t cursor = 0;
+                return {hits_, misses_, entries_.size(), capacity_};
+        }
+private:
+        // The most recently used entries come first.
+        typedef std::list<std::pair<vector<Value>, Value>> Entries;
 
-                Parse(tokens, exprs, cursor);
+        struct ArgsHash {
+                size_t operator()(const vector<Value> *args) const
+                {
+                        size_t h = args->size();
 
-                for (auto in: exprs) {
-                        auto out = Evaluate(in, global_env_);
-                        std::cout << out->ToString() << std::endl;
+                        for (auto e: *args)
+                                h = h * 31 + HashValue(e);
+                        return (h);
+                }
+        };
+
+        struct ArgsEqual {
+                bool operator()(const vector<Value> *a,
+                                const vector<Value> *b) const
+                {
+                        if (a->size() != b->size())
+                                return (false);
+                        for (size_t i = 0; i < a->size(); i++)
+                                if (!SameValue((*a)[i], (*b)[i]))
+                                        return (false);
+                        return (true);
                 }
+        };
+
+        const Value fn_;
+        const size_t capacity_;
+        mutable Entries entries_;
+        // Points to the arguments held by the entries.
+        mutable unordered_map<const vector<Value> *, Entries::iterator,
+                              ArgsHash, ArgsEqual> index_;
+        mutable size_t hits_;
+        mutable size_t misses_;
+        // The procedure may be called by several threads at once.
+        mutable std::mutex lock_;
+};
+
+// A table from keys to values, see MAKE-HASH.  Keys are the same when they
+// are for a memo: symbols by identity, numbers and strings by value.  The
+// entries are kept in a single array, probed linearly from the slot given by
+// the hash of the key so that a lookup mostly reads a single cache line, and
+// a removal moves back the entries after it rather than leaving a mark.
+class HashExpr : public LispExprInterface {
+public:
+        explicit HashExpr(size_t capacity) : count_(0)
+        {
+                size_t slots = kMinSlots;
+
+                while (slots / 4 * 3 < capacity)
+                        slots *= 2;
+                Resize(slots);
         }
 
-private:
-        Env global_env_;
+        virtual ExprKind Type() const { return ExprKind::Hash; }
 
-        void DefPrim(const string& name, const PrimFun *fn, ...)
+        virtual void Trace(Heap& heap) const;
+
+        virtual string ToString() const
         {
-                auto e = new PrimExpr(fn, "<primitive:" + name + '>');
-                global_env_.define(SymbolExpr::GetInstance(name), e);
+
+                return ("<hash:" + std::to_string(Count()) + '>');
         }
 
-        void InitGlobalEnv(void)
+        size_t Count() const
         {
-                DefPrim("+", PrimPlus);
-                DefPrim("-", PrimMinus);
-                DefPrim("*", PrimMul);
-                DefPrim("/", PrimDiv);
-                DefPrim("CONS", PrimCons);
-                DefPrim("CAR", PrimCar);
-                DefPrim("CDR", PrimCdr);
-                DefPrim("NUMBER?", PrimIsNum);
-                DefPrim("SYMBOL?", PrimIsSym);
-                DefPrim("LIST?", PrimIsList);
-                DefPrim("NIL?", PrimIsNil);
-                DefPrim("AND?", PrimIsAnd);
-                DefPrim("OR?", PrimIsOr);
-                DefPrim("EQ?", PrimIsEq);
-                DefPrim("=", PrimIsEqNum);
-                DefPrim("<", PrimIsLtNum);
-                DefPrim(">", PrimIsGtNum);
+                std::lock_guard<std::mutex> guard(lock_);
+
+                return (count_);
         }
 
-        bool IsSeparator(char c)
+        // Sets value to the one of key, unless there is none.
+        bool Get(Value key, Value& value) const
         {
-                return (isspace(c) || c == '(' || c == ')' || c == '"' ||
-                        c == '\'');
+                std::lock_guard<std::mutex> guard(lock_);
+                auto& slot = slots_[Find(key, Hash(key))];
+
+                if (slot.key == kEmpty)
+                        return (false);
+                value = slot.value;
+                return (true);
         }
 
-        bool IsNumber(const string &s, size_t startPos, size_t endPos)
+        void Set(Value key, Value value) const;
+
+        // Returns whether there was an entry for key.
+        bool Remove(Value key) const
         {
-                size_t i;
-                bool hasDot;
+                std::lock_guard<std::mutex> guard(lock_);
+                size_t i = Find(key, Hash(key));
 
-                i = startPos;
-                if (!isdigit(s[i]) &&
-                    !(s[i] == '-' && i+1 < endPos && isdigit(s[i+1])))
+                if (slots_[i].key == kEmpty)
                         return (false);
-
-                hasDot = false;
-                while (++i < endPos)
-                        if (!isdigit(s[i])) {
-                                if (s[i] == '.' && !hasDot)
-                                        hasDot = true;
-                                else
-                                        return (false);
+                // Moves back each entry of the run after i that would not
+                // be found anymore once i is empty.
+                size_t mask = slots_.size() - 1;
+                for (size_t j = (i + 1) & mask; slots_[j].key != kEmpty;
+                     j = (j + 1) & mask) {
+                        size_t home = slots_[j].hash >> shift_;
+                        if (((j - home) & mask) >= ((j - i) & mask)) {
+                                slots_[i] = slots_[j];
+                                i = j;
                         }
-
+                }
+                slots_[i].key = kEmpty;
+                count_--;
                 return (true);
         }
 
-        vector<LispToken> GenerateTokens(const string &s)
+        // The keys and the values, one after the other.
+        vector<Value> Entries() const
         {
-                vector<LispToken> tokenList;
-                size_t i;
-
-                i = 0;
-                while (i < s.length()) {
-                        if (isspace(s[i])) {
-                                i++;
-                                continue;                                
-                        }
-
-                        size_t startPos = i;
-                        switch (s[i]) {
-                        case '"':
-                                startPos++;
-                                while (++i < s.length() && s[i] != '"')
-                                        ;
-                                if (i == s.length())
-                                        throw LispException(
-                                                "Unmatched string quote.");
-                                tokenList.push_back(
-                                        {
-                                                TokenKind::String,
-                                                s.substr(startPos, i - startPos)
-                                        });
-                                i++;
-                                break;
-                        case '(':
-                                // Check for "()" as a special case.
-                                if (++i < s.length() && s[i] == ')') {
-                                        tokenList.push_back({TokenKind::Nil});
-                                        i++;
-                                } else
-                                        tokenList.push_back(
-                                                {TokenKind::BeginParenthesis,
-                                                 "("});
-                                break;
-                        case ')':
-                                tokenList.push_back({
-                                                TokenKind::EndParenthesis,
-                                                ")"});
-                                i++;
-                                break;
-                        case '\'':
-                                tokenList.push_back({
-                                                TokenKind::Quote, "'"});
-                                i++;
-                                break;
-                        default:
-                                while (i < s.length() && !IsSeparator(s[i]))
-                                        i++;
-
-                                string value = s.substr(startPos, i - startPos);
-                                if (IsNumber(s, startPos, i))
-                                        tokenList.push_back(
-                                                {TokenKind::Num, value});
-                                else if (value == "t" || value == "T")
-                                        tokenList.push_back(
-                                                {TokenKind::True, value});
-                                else
-                                        tokenList.push_back(
-                                                {TokenKind::Symbol, value});
-                                break;
+                std::lock_guard<std::mutex> guard(lock_);
+                vector<Value> entries;
+
+                entries.reserve(count_ * 2);
+                for (auto& slot: slots_)
+                        if (slot.key != kEmpty) {
+                                entries.push_back(slot.key);
+                                entries.push_back(slot.value);
                         }
-                }
+                return (entries);
+        }
+private:
+        struct Slot {
+                uint64_t hash;
+                Value key;
+                Value value;
+        };
+
+        static const size_t kMinSlots = 8;
+        // The key of the empty slots, which no value has.
+        static const Value kEmpty;
+
+        // Spreads the bits of HashValue over the upper ones, which choose
+        // the slot.
+        static uint64_t Hash(Value key)
+        {
 
-                return (tokenList);
+                return (HashValue(key) * UINT64_C(0x9e3779b97f4a7c15));
         }
 
-        const PairExpr *
-        ParsePair(const vector<LispToken>& tokens, size_t& cursor)
+        // The slot of key, or the empty one where it would go.
+        size_t Find(Value key, uint64_t hash) const
         {
-                auto e = ParseExpr(tokens, cursor);
-
-                if (cursor == tokens.size())
-                        throw LispException("Missing closing ')'.");
+                size_t mask = slots_.size() - 1;
 
-                if (tokens[cursor].kind == TokenKind::EndParenthesis) {
-                        cursor++;
-                        return (new PairExpr(e, kNil));
+                for (size_t i = hash >> shift_; ; i = (i + 1) & mask) {
+                        auto& slot = slots_[i];
+                        if (slot.key == kEmpty || (slot.hash == hash &&
+                                                   SameValue(slot.key, key)))
+                                return (i);
                 }
+        }
 
-                return (new PairExpr(e, ParsePair(tokens, cursor)));
+        void Resize(size_t slots) const
+        {
+                vector<Slot> old(slots, Slot{0, kEmpty, kNil});
+
+                old.swap(slots_);
+                shift_ = 64;
+                while (slots >>= 1)
+                        shift_--;
+                for (auto& slot: old)
+                        if (slot.key != kEmpty)
+                                slots_[Find(slot.key, slot.hash)] = slot;
         }
 
-        const PairExpr *
-        ParseQuote(const vector<LispToken>& tokens, size_t& cursor)
+        // A power of two of them, at most three quarters used.
+        mutable vector<Slot> slots_;
+        // What to shift a hash right by to get the index of its slot.
+        mutable unsigned shift_;
+        mutable size_t count_;
+        // The table may be used by several threads at once.
+        mutable std::mutex lock_;
+};
+
+const Value HashExpr::kEmpty = Value::FromBits(0);
+
+// The state of the bytecode machine: the operand stack shared by all the
+// calls and the stack of their frames.  Both are kept from a run to the next
+// so that a call costs no allocation once they have grown.
+class Vm {
+public:
+        struct Frame {
+                const Chunk *chunk;
+                // The return address while the frame is calling.
+                size_t pc;
+                // The height of the operand stack on entry.
+                size_t base;
+                // The bindings the code sees: the caller's ones until the
+                // frame binds the arguments of a function in frame.
+                const Env *env;
+                Env frame;
+                vector<const SymbolExpr *> names, scratch;
+                vector<Value> slots;
+                Value fn;
+                // Whether the call of fn is on the profiler.
+                bool profiled;
+                // The memo to store the value returned in, under key.
+                Value memo;
+                vector<Value> key;
+        };
+
+        explicit Vm() : depth_(0) {}
+
+        vector<Value>& Stack() { return (stack_); }
+
+        // Where the arguments of a call are gathered.
+        vector<Value>& Args() { return (args_); }
+
+        size_t Depth() const { return (depth_); }
+
+        Frame *Top() { return (frames_[depth_ - 1].get()); }
+
+        Frame *Push(const Chunk *chunk, const Env *env)
         {
-                auto e = ParseExpr(tokens, cursor);
 
-                return (new PairExpr(
-                                SymbolExpr::GetInstance("QUOTE"),
-                                new PairExpr(e, kNil)));
+                if (depth_ == frames_.size())
+                        frames_.emplace_back(new Frame());
+                auto f = frames_[depth_++].get();
+                f->chunk = chunk;
+                f->pc = 0;
+                f->base = stack_.size();
+                f->env = env;
+                f->profiled = false;
+                // What a previous call left is not live any more.
+                f->fn = kNil;
+                f->memo = kNil;
+                f->slots.clear();
+                f->key.clear();
+                return (f);
         }
 
-        const LispExprInterface *
-        ParseExpr(const vector<LispToken>& tokens, size_t& cursor)
+        void Pop() { depth_--; }
+
+        // Forgets the arguments of the last call once the outermost run is
+        // over: the objects of the form may be released with it.
+        void Stop() { args_.clear(); }
+
+        // Drops the frames and the operands pushed since the given depth
+        // and height, after an error.
+        void Unwind(size_t depth, size_t height)
         {
-                if (cursor == tokens.size())
-                        throw LispException("Unexpected end of the input.");
-                auto& t = tokens[cursor++];
-                switch (t.kind) {
-                case TokenKind::Num:
-                        return (new NumExpr(std::stof(t.value)));
-                        break;
-                case TokenKind::String:
-                        return (new StrExpr(t.value));
-                        break;
-                case TokenKind::Nil:
-                        return (kNil);
-                        break;
-                case TokenKind::Symbol:
-                        return (SymbolExpr::GetInstance(t.value));
-                        break;
-                case TokenKind::BeginParenthesis:
-                        return (ParsePair(tokens, cursor));
-                        break;
-                case TokenKind::True:
-                        return (kTrue);
-                        break;
-                case TokenKind::Quote:
-                        return (ParseQuote(tokens, cursor));
-                        break;
-                default:
-                        throw LispException(
-                                "Unexpected kind: " + t.value);
-                        break;
-                }
+
+                depth_ = depth;
+                stack_.resize(height);
         }
 
-        void Parse(const vector<LispToken>& tokens,
-                   vector<const LispExprInterface *>& exprs,
-                   size_t& cursor)
+        void Trace(Heap& heap) const;
+private:
+        vector<Value> stack_;
+        vector<Value> args_;
+        vector<std::unique_ptr<Frame>> frames_;
+        size_t depth_;
+};
+
+// Every expression allocated through the heap is preceded by a GcHeader.
+struct GcHeader {
+        enum State : uint8_t {
+                kFree,
+                kLive,
+                // The constructor threw: the cell is reclaimed by the next
+                // sweep without running the destructor.
+                kAbandoned,
+        };
+
+        uint32_t size;
+        State state;
+        bool marked;
+};
+
+// Expressions are small and of a handful of sizes, so they are carved out of
+// cache line aligned slabs, one pool per size class.  A pool hands out cells
+// from its free list first and then bumps a pointer through its last slab.
+// Objects too large for any class are malloc'ed one by one.
+class Pool {
+public:
+        static const size_t kSlabSize = 64 * 1024;
+        static const size_t kCacheLine = 64;
+
+        explicit Pool() : cell_size_(0), free_(NULL), top_(NULL), end_(NULL) {}
+
+        ~Pool()
         {
-                while (cursor < tokens.size()) {
-                        auto e = ParseExpr(tokens, cursor);
-                        exprs.push_back(e);
-                }
+                for (auto slab: slabs_)
+                        std::free(slab.memory);
         }
 
-        const bool StartsWith(const PairExpr *p, const string& s)
-        {
-                auto first = p->First();
-                if (first->Type() != ExprKind::Symbol)
-                        return (false);
+        void Init(size_t cell_size) { cell_size_ = cell_size; }
 
-                return (static_cast<const SymbolExpr *>(first)->IsEqual(s));
-        }
+        size_t CellSize() const { return (cell_size_); }
 
-        const bool IsList(const PairExpr *p, size_t& len)
+        GcHeader *Allocate()
         {
-                len = 1;
-                while (p->Second()->Type() == ExprKind::Pair) {
-                        len++;
-                        p = static_cast<const PairExpr *>(p->Second());
+                if (free_ != NULL) {
+                        auto h = free_;
+                        free_ = NextFree(h);
+                        return (h);
                 }
 
-                return (p->Second()->Type() == ExprKind::Nil);
+                if (top_ == end_)
+                        Grow();
+
+                auto h = reinterpret_cast<GcHeader *>(top_);
+                top_ += cell_size_;
+
+                return (h);
         }
 
-        const void AssertList(const PairExpr *p, size_t n)
+        void Free(GcHeader *h)
         {
-                size_t m;
+                h->state = GcHeader::kFree;
+                NextFree(h) = free_;
+                free_ = h;
+        }
 
-                if (IsList(p, m) && m == n)
-                        return;
+        // Calls fn on every cell handed out so far.
+        template <typename F>
+        void ForEach(F fn) const
+        {
 
-                throw LispException(p->ToString());
+                for (auto& slab: slabs_) {
+                        auto end = slab.cells + (&slab == &slabs_.back() ?
+                                                 top_ - slab.cells :
+                                                 slab.size);
+                        for (auto c = slab.cells; c < end; c += cell_size_)
+                                fn(reinterpret_cast<GcHeader *>(c));
+                }
         }
 
-        const LispExprInterface *Nth(const PairExpr *p, size_t n)
+        // Calls fn on every cell handed out so far, and rebuilds the free
+        // list from the cells it leaves free.
+        template <typename F>
+        void Sweep(F fn)
         {
-                while (n--)
-                        p = static_cast<const PairExpr *>(p->Second());
 
-                return (p->First());
+                free_ = NULL;
+                ForEach([this, &fn](GcHeader *h) {
+                        fn(h);
+                        if (h->state == GcHeader::kFree)
+                                Free(h);
+                });
         }
+private:
+        struct Slab {
+                char *memory;
+                char *cells;
+                size_t size;
+        };
 
-        const vector<const SymbolExpr *>
-        FunParams(const LispExprInterface *args)
+        static GcHeader *& NextFree(GcHeader *h)
         {
-                vector<const SymbolExpr *> params;
+                return (*reinterpret_cast<GcHeader **>(h + 1));
+        }
 
-                while (args->Type() != ExprKind::Nil) {
-                        auto p = PairCast(args);
+        void Grow()
+        {
+                auto memory = static_cast<char *>(
+                        std::malloc(kSlabSize + kCacheLine));
+
+                if (memory == NULL)
+                        throw std::bad_alloc();
+
+                auto offset = reinterpret_cast<uintptr_t>(memory) % kCacheLine;
+                auto cells = memory + (offset ? kCacheLine - offset : 0);
+                size_t size = kSlabSize - kSlabSize % cell_size_;
+
+                slabs_.push_back({memory, cells, size});
+                top_ = cells;
+                end_ = cells + size;
+        }
+
+        size_t cell_size_;
+        GcHeader *free_;
+        char *top_;
+        char *end_;
+        vector<Slab> slabs_;
+};
+
+// A mark-and-sweep collector for the expressions, i.e. every value but the
+// immediate ones.
+//
+// The roots are the environments (the global ones and every frame live in
+// Apply) and the C++ locals registered through GcRoot.  A collection only
+// happens at a safepoint, i.e. when MaybeCollect() is called, where every
+// temporary held by the evaluator is known to be rooted.  Primitives and the
+// parser can therefore allocate freely.  The code compiled to C++ roots
+// nothing, and holds the collections off while it calls back (see Hold).
+//
+// On top of that, the heap can track a region: the objects allocated between
+// BeginRegion() and EndRegion().  If nothing allocated in the region escaped
+// (see Escape()) and no collection ran meanwhile, EndRegion() releases the
+// whole region at once without tracing anything.
+//
+// Tasks run on the threads of the ThreadPool evaluate in the same heap.  As
+// long as a task is pending, the heap neither collects nor tracks a region,
+// and allocates under a lock.  The threads of the pool register no roots: a
+// collection never happens while they run.
+class Heap {
+public:
+        explicit Heap(Heap const&)              = delete;
+        void operator=(Heap const&)             = delete;
+
+        // Each thread allocates in a heap of its own, but for the tasks of
+        // the ThreadPool that allocate in the heap of the thread that queued
+        // them.
+        static Heap& GetInstance()
+        {
+                if (current_ == NULL) {
+                        static thread_local Heap instance;
+                        current_ = &instance;
+                }
+                return (*current_);
+        }
+
+        void *Allocate(size_t size)
+        {
+                if (Shared()) {
+                        std::lock_guard<std::mutex> guard(lock_);
+                        return (AllocateCell(size));
+                }
+                return (AllocateCell(size));
+        }
+
+        // Counts the tasks pending, from the time they are queued to the
+        // time they are done.
+        void BeginTask()
+        {
+                tasks_++;
+                region_open_ = false;
+        }
+
+        void EndTask() { tasks_--; }
+
+        bool Shared() const { return (tasks_.load() != 0); }
+
+        // The number of objects allocated so far.
+        size_t Allocations() const { return (allocations_); }
+
+        // The number of bytes allocated so far, headers included.
+        size_t Bytes() const { return (bytes_); }
+
+        // Counts per kind the objects allocated so far and those of them
+        // not reclaimed yet, which the heap walked finds live, and the bytes
+        // these take.  Waits for the tasks pending first, that may be
+        // building objects.
+        void Census(vector<size_t>& allocated, vector<size_t>& live,
+                    size_t& bytes);
+
+        // The hash-consing table of the objects of the heap.
+        HashCons& hash_cons() { return (*hash_cons_); }
+
+        // Runs a task of the heap on the thread while in scope: the thread
+        // allocates in the heap, and registers no roots.
+        class TaskScope {
+        public:
+                explicit TaskScope(TaskScope const&)    = delete;
+                void operator=(TaskScope const&)        = delete;
+
+                explicit TaskScope(Heap& heap) :
+                        saved_heap_(current_), saved_in_task_(in_task_)
+                {
+                        current_ = &heap;
+                        in_task_ = true;
+                }
+
+                ~TaskScope()
+                {
+                        current_ = saved_heap_;
+                        in_task_ = saved_in_task_;
+                }
+        private:
+                Heap *saved_heap_;
+                bool saved_in_task_;
+        };
+
+        void Abandon(void *p)
+        {
+                (static_cast<GcHeader *>(p) - 1)->state = GcHeader::kAbandoned;
+        }
+
+        void Mark(Value v)
+        {
+                if (!v.IsObject())
+                        return;
+
+                auto e = v.AsObject();
+                auto h = HeaderOf(e);
+                if (h->marked)
+                        return;
+                h->marked = true;
+                gray_.push_back(e);
+        }
+
+        bool Marked(const LispExprInterface *e) const
+        {
+
+                return (HeaderOf(e)->marked);
+        }
+
+        // Collect once the memory allocated since the last collection
+        // outgrows what survived it, so the heap stays within a constant
+        // factor of the live data.
+        void MaybeCollect()
+        {
+                if (!Shared() && holds_.load() == 0 &&
+                    allocated_ >= threshold_)
+                        Collect();
+        }
+
+        // Holds the collections off while in scope, for the code that
+        // keeps values where the collector doesn't look for roots.
+        class Hold {
+        public:
+                explicit Hold(Hold const&)              = delete;
+                void operator=(Hold const&)             = delete;
+
+                explicit Hold(Heap& heap) : heap_(heap) { heap_.holds_++; }
+
+                ~Hold() { heap_.holds_--; }
+        private:
+                Heap& heap_;
+        };
+
+        void Collect();
+
+        void BeginRegion()
+        {
+                region_.clear();
+                region_open_ = !Shared();
+        }
+
+        // Called when an object may have been stored where it outlives the
+        // region, e.g. in a global environment.
+        void Escape() { region_open_ = false; }
+
+        void EndRegion();
+
+        void PushRoot(const Value *e) { AddRoot(expr_roots_, e); }
+
+        void PushRoot(const vector<Value> *v) { AddRoot(vector_roots_, v); }
+
+        void PushRoot(const Env *env) { AddRoot(env_roots_, env); }
+
+        void PushRoot(const GlobalEnv *env) { AddRoot(global_roots_, env); }
+
+        void PushRoot(const Vm *vm) { AddRoot(vm_roots_, vm); }
+
+        void PopRoot(const Value *e)
+        {
+                RemoveRoot(expr_roots_, e);
+        }
+
+        void PopRoot(const vector<Value> *v)
+        {
+                RemoveRoot(vector_roots_, v);
+        }
+
+        void PopRoot(const Env *env) { RemoveRoot(env_roots_, env); }
+
+        void PopRoot(const GlobalEnv *env)
+        {
+                RemoveRoot(global_roots_, env);
+        }
+
+        void PopRoot(const Vm *vm) { RemoveRoot(vm_roots_, vm); }
+private:
+        static const size_t kMinThreshold = 1 << 20;
+        static const size_t kGranule = 16;
+        static const size_t kNumClasses = 8;
+        static const size_t kMaxRegion = 1 << 16;
+
+        explicit Heap();
+
+        ~Heap();
+
+        void *AllocateCell(size_t size)
+        {
+                size_t cls = ClassOf(size);
+                GcHeader *h;
+
+                if (cls < kNumClasses) {
+                        h = pools_[cls].Allocate();
+                        allocated_ += pools_[cls].CellSize();
+                        bytes_ += pools_[cls].CellSize();
+                } else {
+                        h = static_cast<GcHeader *>(
+                                std::malloc(sizeof(GcHeader) + size));
+                        if (h == NULL)
+                                throw std::bad_alloc();
+                        large_.push_back(h);
+                        allocated_ += sizeof(GcHeader) + size;
+                        bytes_ += sizeof(GcHeader) + size;
+                }
+
+                h->size = size;
+                h->state = GcHeader::kLive;
+                h->marked = false;
+                allocations_++;
+
+                if (region_open_ && region_.size() < kMaxRegion)
+                        region_.push_back(h);
+                else
+                        region_open_ = false;
+
+                return (h + 1);
+        }
+
+        static size_t ClassOf(size_t size)
+        {
+                return ((sizeof(GcHeader) + size - 1) / kGranule);
+        }
+
+        static GcHeader *HeaderOf(const LispExprInterface *e)
+        {
+                return (reinterpret_cast<GcHeader *>(
+                                const_cast<LispExprInterface *>(e)) - 1);
+        }
+
+        static LispExprInterface *ObjectOf(GcHeader *h)
+        {
+                return (reinterpret_cast<LispExprInterface *>(h + 1));
+        }
+
+        template <typename T>
+        static void AddRoot(vector<T>& roots, T root)
+        {
+                if (!in_task_)
+                        roots.push_back(root);
+        }
+
+        // Roots are mostly pushed and popped in LIFO order, search from the
+        // top of the stack.
+        template <typename T>
+        static void RemoveRoot(vector<T>& roots, T root)
+        {
+                if (in_task_)
+                        return;
+                for (size_t i = roots.size(); i-- > 0; )
+                        if (roots[i] == root) {
+                                roots.erase(roots.begin() + i);
+                                return;
+                        }
+                assert(false);
+        }
+
+        // Runs the destructor of a cell that is about to be reused, and
+        // counts the object reclaimed.
+        void Destroy(GcHeader *h)
+        {
+                if (h->state == GcHeader::kLive) {
+                        auto e = ObjectOf(h);
+                        reclaimed_[static_cast<size_t>(e->Type())]++;
+                        e->~LispExprInterface();
+                }
+                h->state = GcHeader::kFree;
+        }
+
+        void Sweep();
+
+        Pool pools_[kNumClasses];
+        vector<GcHeader *> large_;
+        size_t allocated_;
+        size_t allocations_;
+        size_t bytes_;
+        // Per kind.
+        size_t reclaimed_[kNumKinds];
+        size_t threshold_;
+        vector<GcHeader *> region_;
+        std::atomic<bool> region_open_;
+        vector<const LispExprInterface *> gray_;
+        vector<const Value *> expr_roots_;
+        vector<const vector<Value> *> vector_roots_;
+        vector<const Env *> env_roots_;
+        vector<const GlobalEnv *> global_roots_;
+        vector<const Vm *> vm_roots_;
+        std::atomic<size_t> tasks_;
+        // The Holds in scope, on any thread allocating here.
+        std::atomic<size_t> holds_;
+        std::mutex lock_;
+        HashCons *hash_cons_;
+        static thread_local Heap *current_;
+        static thread_local bool in_task_;
+};
+
+thread_local Heap *Heap::current_ = NULL;
+thread_local bool Heap::in_task_ = false;
+
+// With hash-consing on, the objects that can't change once built, the
+// pairs, the strings and the numbers that are not fixnums, are built through
+// this table, so that structurally equal ones are one and the same object:
+// repeated data is stored once and EQ? compares lists in a single test.  The
+// parts of a pair are shared already, so a pair is looked up by their words.
+// The table doesn't keep its objects alive, the collector makes it forget
+// the ones it didn't mark before sweeping them.  Each heap has a table of
+// its own.
+//
+// Even with hash-consing off, the string literals read share the buffers of
+// their characters, which the table keeps until no string uses them anymore.
+class HashCons {
+public:
+        explicit HashCons(HashCons const&)      = delete;
+        void operator=(HashCons const&)         = delete;
+
+        // The table of the heap the thread allocates in.
+        static HashCons& GetInstance()
+        {
+                return (Heap::GetInstance().hash_cons());
+        }
+
+        static bool Enabled() { return (enabled_); }
+
+        // Turns hash-consing on in all the heaps, before any is used.
+        static void Enable() { enabled_ = true; }
+
+        const PairExpr *Pair(Value first, Value second)
+        {
+                auto guard = Lock();
+                auto key = std::make_pair(first.Bits(), second.Bits());
+                auto search = pairs_.find(key);
+
+                if (search != pairs_.end())
+                        return (search->second);
+                auto e = Shared(new PairExpr(first, second));
+                return (pairs_[key] = e);
+        }
+
+        // The string with the characters of e, e itself if it is the
+        // first.
+        const StrExpr *String(const StrExpr *e)
+        {
+                auto guard = Lock();
+                Chars key(e->Data(), e->Size());
+                auto search = strings_.find(key);
+
+                if (search != strings_.end())
+                        return (search->second);
+                return (strings_[key] = Shared(e));
+        }
+
+        StrExpr *Literal(const string& s)
+        {
+                auto guard = Lock();
+                auto search = literals_.find(Chars(s.data(), s.size()));
+
+                if (search != literals_.end())
+                        return (new StrExpr(search->second, 0, s.size()));
+                auto e = new StrExpr(s);
+                literals_[Chars(e->Data(), e->Size())] = e->buf();
+                return (e);
+        }
+
+        const NumExpr *Int(int64_t i)
+        {
+                auto guard = Lock();
+                auto search = ints_.find(i);
+
+                if (search != ints_.end())
+                        return (search->second);
+                auto e = Shared(new NumExpr(i));
+                return (ints_[i] = e);
+        }
+
+        // The reals are told apart bit for bit, as 0.0 and -0.0 are.
+        const NumExpr *Real(double d)
+        {
+                auto guard = Lock();
+                uint64_t bits;
+
+                std::memcpy(&bits, &d, sizeof(bits));
+                auto search = reals_.find(bits);
+                if (search != reals_.end())
+                        return (search->second);
+                auto e = Shared(new NumExpr(d));
+                return (reals_[bits] = e);
+        }
+
+        // Called by the collector once the live objects are marked.
+        void Purge(const Heap& heap)
+        {
+                Forget(pairs_, heap);
+                Forget(strings_, heap);
+                Forget(ints_, heap);
+                Forget(reals_, heap);
+                for (auto i = literals_.begin(); i != literals_.end(); )
+                        if (i->second.use_count() > 1)
+                                ++i;
+                        else
+                                i = literals_.erase(i);
+        }
+private:
+        struct WordsHash {
+                size_t operator()(const std::pair<uint64_t, uint64_t>& k)
+                        const
+                {
+                        return (std::hash<uint64_t>()(k.first * 31 +
+                                                      k.second));
+                }
+        };
+
+        // The characters of a string, in its buffer.
+        typedef std::pair<const char *, size_t> Chars;
+
+        struct CharsHash {
+                size_t operator()(const Chars& s) const
+                {
+                        return (HashChars(s.first, s.second));
+                }
+        };
+
+        struct CharsEqual {
+                bool operator()(const Chars& a, const Chars& b) const
+                {
+                        return (a.second == b.second &&
+                                std::memcmp(a.first, b.first,
+                                            a.second) == 0);
+                }
+        };
+
+        friend class Heap;
+
+        explicit HashCons() {}
+
+        // The table is only shared while tasks are running.
+        std::unique_lock<std::mutex> Lock()
+        {
+                std::unique_lock<std::mutex> guard(lock_, std::defer_lock);
+
+                if (Heap::GetInstance().Shared())
+                        guard.lock();
+                return (guard);
+        }
+
+        // A shared object may be used by any later expression, it must not
+        // be released with the region it was allocated in.
+        template <typename T>
+        static const T *Shared(const T *e)
+        {
+                Heap::GetInstance().Escape();
+                return (e);
+        }
+
+        template <typename M>
+        static void Forget(M& table, const Heap& heap)
+        {
+                for (auto i = table.begin(); i != table.end(); )
+                        if (heap.Marked(i->second))
+                                ++i;
+                        else
+                                i = table.erase(i);
+        }
+
+        static bool enabled_;
+        unordered_map<std::pair<uint64_t, uint64_t>, const PairExpr *,
+                      WordsHash> pairs_;
+        // Points to the characters of the objects.
+        unordered_map<Chars, const StrExpr *, CharsHash, CharsEqual> strings_;
+        unordered_map<Chars, std::shared_ptr<StrBuf>, CharsHash,
+                      CharsEqual> literals_;
+        unordered_map<int64_t, const NumExpr *> ints_;
+        unordered_map<uint64_t, const NumExpr *> reals_;
+        std::mutex lock_;
+};
+
+bool HashCons::enabled_ = false;
+
+Heap::Heap() :
+        allocated_(0), allocations_(0), bytes_(0), reclaimed_(),
+        threshold_(kMinThreshold), region_open_(false),
+        tasks_(0), holds_(0), hash_cons_(new HashCons())
+{
+        for (size_t i = 0; i < kNumClasses; i++)
+                pools_[i].Init((i + 1) * kGranule);
+}
+
+void Heap::Collect()
+{
+        for (auto e: expr_roots_)
+                Mark(*e);
+        for (auto v: vector_roots_)
+                for (auto e: *v)
+                        Mark(e);
+        for (auto env: env_roots_)
+                env->Trace(*this);
+        for (auto env: global_roots_)
+                env->Trace(*this);
+        for (auto vm: vm_roots_)
+                vm->Trace(*this);
+
+        // Use an explicit mark stack, long lists would otherwise overflow
+        // the C++ one.
+        while (!gray_.empty()) {
+                auto e = gray_.back();
+                gray_.pop_back();
+                e->Trace(*this);
+        }
+
+        hash_cons_->Purge(*this);
+        Sweep();
+
+        // The cells recorded in the region may have been reused.
+        region_open_ = false;
+}
+
+void Heap::Sweep()
+{
+        size_t live = 0;
+
+        for (auto& pool: pools_)
+                pool.Sweep([this, &live, &pool](GcHeader *h) {
+                        if (h->marked) {
+                                h->marked = false;
+                                live += pool.CellSize();
+                        } else
+                                Destroy(h);
+                });
+
+        size_t n = 0;
+        for (auto h: large_) {
+                if (h->marked) {
+                        h->marked = false;
+                        live += sizeof(GcHeader) + h->size;
+                        large_[n++] = h;
+                } else {
+                        Destroy(h);
+                        std::free(h);
+                }
+        }
+        large_.resize(n);
+
+        allocated_ = 0;
+        threshold_ = std::max(live, static_cast<size_t>(kMinThreshold));
+}
+
+void Heap::EndRegion()
+{
+        if (!region_open_)
+                return;
+        region_open_ = false;
+
+        for (auto h: region_) {
+                size_t cls = ClassOf(h->size);
+                if (cls >= kNumClasses)
+                        // Large objects are left to the collector.
+                        continue;
+                Destroy(h);
+                pools_[cls].Free(h);
+                allocated_ -= std::min(allocated_, pools_[cls].CellSize());
+        }
+        region_.clear();
+}
+
+// Releases the objects allocated during its lifetime unless they escaped.
+class HeapRegion {
+public:
+        explicit HeapRegion(HeapRegion const&)  = delete;
+        void operator=(HeapRegion const&)       = delete;
+
+        explicit HeapRegion() { Heap::GetInstance().BeginRegion(); }
+        ~HeapRegion() { Heap::GetInstance().EndRegion(); }
+};
+
+// Registers a C++ local with the collector for the lifetime of the guard.
+class GcRoot {
+public:
+        explicit GcRoot(GcRoot const&)          = delete;
+        void operator=(GcRoot const&)           = delete;
+
+        explicit GcRoot(const Value *e) :
+                expr_(e), vector_(NULL), env_(NULL), global_(NULL), vm_(NULL)
+        {
+                Heap::GetInstance().PushRoot(e);
+        }
+
+        explicit GcRoot(const vector<Value> *v) :
+                expr_(NULL), vector_(v), env_(NULL), global_(NULL), vm_(NULL)
+        {
+                Heap::GetInstance().PushRoot(v);
+        }
+
+        explicit GcRoot(const Env *env) :
+                expr_(NULL), vector_(NULL), env_(env), global_(NULL),
+                vm_(NULL)
+        {
+                Heap::GetInstance().PushRoot(env);
+        }
+
+        explicit GcRoot(const GlobalEnv *env) :
+                expr_(NULL), vector_(NULL), env_(NULL), global_(env),
+                vm_(NULL)
+        {
+                Heap::GetInstance().PushRoot(env);
+        }
+
+        explicit GcRoot(const Vm *vm) :
+                expr_(NULL), vector_(NULL), env_(NULL), global_(NULL), vm_(vm)
+        {
+                Heap::GetInstance().PushRoot(vm);
+        }
+
+        ~GcRoot()
+        {
+                auto& heap = Heap::GetInstance();
+
+                if (expr_)
+                        heap.PopRoot(expr_);
+                else if (vector_)
+                        heap.PopRoot(vector_);
+                else if (env_)
+                        heap.PopRoot(env_);
+                else if (global_)
+                        heap.PopRoot(global_);
+                else
+                        heap.PopRoot(vm_);
+        }
+private:
+        const Value *expr_;
+        const vector<Value> *vector_;
+        const Env *env_;
+        const GlobalEnv *global_;
+        const Vm *vm_;
+};
+
+void *LispExprInterface::operator new(size_t size)
+{
+
+        return (Heap::GetInstance().Allocate(size));
+}
+
+void LispExprInterface::operator delete(void *p)
+{
+
+        Heap::GetInstance().Abandon(p);
+}
+
+VecExpr *VecExpr::Make(size_t n)
+{
+
+        if (n > (SIZE_MAX - sizeof(VecExpr)) / sizeof(double))
+                throw std::bad_alloc();
+        void *p = Heap::GetInstance().Allocate(sizeof(VecExpr) +
+                                               n * sizeof(double));
+        return (::new (p) VecExpr(n));
+}
+
+void PairExpr::Trace(Heap& heap) const
+{
+        heap.Mark(first_);
+        heap.Mark(second_);
+}
+
+void GlobalEnv::Trace(Heap& heap) const
+{
+        for (auto& cell: cells_)
+                heap.Mark(cell.value);
+}
+
+void Env::Trace(Heap& heap) const
+{
+        for (size_t i = 0; i < size_; i++)
+                heap.Mark(slots_[i]);
+}
+
+void Vm::Trace(Heap& heap) const
+{
+        for (auto e: stack_)
+                heap.Mark(e);
+        for (auto e: args_)
+                heap.Mark(e);
+        for (size_t i = 0; i < depth_; i++) {
+                for (auto e: frames_[i]->slots)
+                        heap.Mark(e);
+                heap.Mark(frames_[i]->fn);
+                heap.Mark(frames_[i]->memo);
+                for (auto e: frames_[i]->key)
+                        heap.Mark(e);
+        }
+}
+
+void FunExpr::Trace(Heap& heap) const
+{
+        heap.Mark(body_);
+        heap.Mark(code_);
+}
+
+void MemoExpr::Trace(Heap& heap) const
+{
+        heap.Mark(fn_);
+        for (auto& entry: entries_) {
+                for (auto e: entry.first)
+                        heap.Mark(e);
+                heap.Mark(entry.second);
+        }
+}
+
+void HashExpr::Trace(Heap& heap) const
+{
+        for (auto& slot: slots_)
+                if (slot.key != kEmpty) {
+                        heap.Mark(slot.key);
+                        heap.Mark(slot.value);
+                }
+}
+
+void HashExpr::Set(Value key, Value value) const
+{
+        std::lock_guard<std::mutex> guard(lock_);
+        auto hash = Hash(key);
+        size_t i = Find(key, hash);
+
+        // The key and the value may have been allocated in the region of
+        // the expression being processed.
+        Heap::GetInstance().Escape();
+
+        if (slots_[i].key == kEmpty) {
+                if ((count_ + 1) * 4 > slots_.size() * 3) {
+                        Resize(slots_.size() * 2);
+                        i = Find(key, hash);
+                }
+                slots_[i].hash = hash;
+                slots_[i].key = key;
+                count_++;
+        }
+        slots_[i].value = value;
+}
+
+void MemoExpr::Store(const vector<Value>& args, Value e) const
+{
+        std::lock_guard<std::mutex> guard(lock_);
+        auto search = index_.find(&args);
+
+        // The arguments and the value may have been allocated in the region
+        // of the expression being processed.
+        Heap::GetInstance().Escape();
+
+        if (search != index_.end()) {
+                search->second->second = e;
+                return;
+        }
+
+        entries_.emplace_front(args, e);
+        index_[&entries_.front().first] = entries_.begin();
+        if (entries_.size() > capacity_) {
+                index_.erase(&entries_.back().first);
+                entries_.pop_back();
+        }
+}
+
+// Runs tasks on as many threads as the machine has cores, counting the
+// thread waiting for them: it runs queued tasks too while it waits.  Each
+// worker takes the tasks it queued itself last in first out, and steals the
+// oldest task of another one when it has none left.  The tasks queued by
+// other threads are spread over the workers in turn.
+class ThreadPool {
+public:
+        typedef std::function<void()> Task;
+
+        explicit ThreadPool(ThreadPool const&)  = delete;
+        void operator=(ThreadPool const&)       = delete;
+
+        // The pool starts on first use and is never stopped.
+        static ThreadPool& GetInstance()
+        {
+                static ThreadPool *instance = new ThreadPool();
+
+                return (*instance);
+        }
+
+        // Sets the number of threads, before the pool starts.
+        static void SetThreads(size_t n) { threads_ = n; }
+
+        size_t Threads() const { return (queues_.size()); }
+
+        void Submit(Task task)
+        {
+                size_t i = index_ != 0 ? index_ - 1 :
+                        next_++ % queues_.size();
+
+                auto& heap = Heap::GetInstance();
+                heap.BeginTask();
+                {
+                        std::lock_guard<std::mutex> guard(queues_[i]->lock);
+                        queues_[i]->tasks.push_back(
+                                Pending{std::move(task), &heap});
+                }
+                std::lock_guard<std::mutex> guard(lock_);
+                queued_++;
+                changed_.notify_all();
+        }
+
+        // Runs the tasks queued until done() holds.
+        template <typename F>
+        void Wait(F done)
+        {
+                while (!done()) {
+                        if (RunOne())
+                                continue;
+                        std::unique_lock<std::mutex> guard(lock_);
+                        changed_.wait(guard, [&]() {
+                                return (queued_ != 0 || done());
+                        });
+                }
+        }
+private:
+        // A task, and the heap of the thread that queued it.
+        struct Pending {
+                Task task;
+                Heap *heap;
+        };
+
+        struct Queue {
+                std::mutex lock;
+                std::deque<Pending> tasks;
+        };
+
+        explicit ThreadPool() : next_(0), queued_(0)
+        {
+                size_t n = threads_;
+
+                if (n == 0)
+                        n = std::max(std::thread::hardware_concurrency(), 1u);
+                for (size_t i = 0; i < n; i++)
+                        queues_.emplace_back(new Queue());
+                // The last queue has no worker, the waiting threads drain it.
+                for (size_t i = 0; i + 1 < n; i++)
+                        std::thread(&ThreadPool::Work, this, i).detach();
+        }
+
+        void Work(size_t i)
+        {
+                index_ = i + 1;
+                Wait([]() { return (false); });
+        }
+
+        bool Take(Pending& task)
+        {
+                size_t n = queues_.size();
+                size_t self = index_ != 0 ? index_ - 1 : 0;
+
+                for (size_t k = 0; k < n; k++) {
+                        auto& q = *queues_[(self + k) % n];
+                        std::lock_guard<std::mutex> guard(q.lock);
+                        if (q.tasks.empty())
+                                continue;
+                        if (k == 0 && index_ != 0) {
+                                task = std::move(q.tasks.back());
+                                q.tasks.pop_back();
+                        } else {
+                                task = std::move(q.tasks.front());
+                                q.tasks.pop_front();
+                        }
+                        std::lock_guard<std::mutex> count(lock_);
+                        queued_--;
+                        return (true);
+                }
+                return (false);
+        }
+
+        bool RunOne()
+        {
+                Pending pending;
+
+                if (!Take(pending))
+                        return (false);
+                {
+                        Heap::TaskScope scope(*pending.heap);
+                        pending.task();
+                        // What the task holds goes before the heap stops
+                        // sharing.
+                        pending.task = nullptr;
+                }
+                pending.heap->EndTask();
+                std::lock_guard<std::mutex> guard(lock_);
+                changed_.notify_all();
+                return (true);
+        }
+
+        vector<std::unique_ptr<Queue>> queues_;
+        std::atomic<size_t> next_;
+        // Counts the tasks in the queues, and signals their changes and the
+        // tasks done.
+        std::mutex lock_;
+        std::condition_variable changed_;
+        size_t queued_;
+        static size_t threads_;
+        // One more than the index of the worker running on the thread, 0 on
+        // the other threads.
+        static thread_local size_t index_;
+};
+
+size_t ThreadPool::threads_ = 0;
+thread_local size_t ThreadPool::index_ = 0;
+
+Heap::~Heap()
+{
+        // The tasks still queued allocate here.
+        ThreadPool::GetInstance().Wait([this]() {
+                return (!Shared());
+        });
+
+        for (auto& pool: pools_)
+                pool.Sweep([this](GcHeader *h) { Destroy(h); });
+        for (auto h: large_) {
+                Destroy(h);
+                std::free(h);
+        }
+        delete hash_cons_;
+}
+
+void Heap::Census(vector<size_t>& allocated, vector<size_t>& live,
+                  size_t& bytes)
+{
+        // The cells the tasks allocate may not be built yet.
+        if (in_task_)
+                throw LispException(
+                        "Can't count the objects of the heap in a task.");
+        ThreadPool::GetInstance().Wait([this]() {
+                return (!Shared());
+        });
+
+        allocated.assign(reclaimed_, reclaimed_ + kNumKinds);
+        live.assign(kNumKinds, 0);
+        bytes = 0;
+        auto count = [&allocated, &live, &bytes](GcHeader *h, size_t size) {
+                if (h->state != GcHeader::kLive)
+                        return;
+                auto kind = static_cast<size_t>(ObjectOf(h)->Type());
+                allocated[kind]++;
+                live[kind]++;
+                bytes += size;
+        };
+        for (auto& pool: pools_)
+                pool.ForEach([&count, &pool](GcHeader *h) {
+                        count(h, pool.CellSize());
+                });
+        for (auto h: large_)
+                count(h, sizeof(GcHeader) + h->size);
+}
+
+// The value of a call run by a task of the pool, see FUTURE.
+class FutureExpr : public LispExprInterface {
+public:
+        // What the task leaves: the value of the call or the error it
+        // raised.
+        struct Result {
+                Result() : done(false), failed(false) {}
+
+                std::atomic<bool> done;
+                bool failed;
+                Value value;
+                string error;
+        };
+
+        explicit FutureExpr(const std::shared_ptr<Result>& result) :
+                result_(result)
+        {}
+
+        virtual ExprKind Type() const { return ExprKind::Future; }
+
+        virtual string ToString() const { return ("<future>"); }
+
+        // The heap doesn't collect while a task is pending, so the result
+        // is there.
+        virtual void Trace(Heap& heap) const { heap.Mark(result_->value); }
+
+        // Waits for the value, running queued tasks meanwhile.
+        Value Touch() const
+        {
+                auto result = result_;
+
+                ThreadPool::GetInstance().Wait([result]() {
+                        return (result->done.load());
+                });
+                if (result->failed)
+                        throw LispException(result->error);
+                return (result->value);
+        }
+private:
+        const std::shared_ptr<Result> result_;
+};
+
+const void
+AssertArgsNum(const string& name,
+              vector<Value>& args,
+              size_t n)
+{
+        if (args.size() == n)
+                return;
+        throw LispException(name + ": Wrong number of arguments.");
+}
+
+// A number unboxed for arithmetic: an exact 64-bit integer or a double.
+struct Number {
+        bool exact;
+        int64_t i;
+        double d;
+
+        static Number Int(int64_t i) { return {true, i, 0}; }
+        static Number Real(double d) { return {false, 0, d}; }
+
+        double ToReal() const
+        {
+                return (exact ? static_cast<double>(i) : d);
+        }
+};
+
+Number NumCast(Value e)
+{
+
+        if (e.IsFixnum())
+                return (Number::Int(e.AsFixnum()));
+
+        if (e.Type() != ExprKind::Num)
+                throw LispException("Not a number: " + e.ToString());
+
+        auto n = static_cast<const NumExpr *>(e.AsObject());
+        if (n->IsExact())
+                return (Number::Int(n->Int()));
+        return (Number::Real(n->Real()));
+}
+
+// The constructors of the data that is hash-consed, see HashCons.
+Value MakeInt(int64_t i)
+{
+
+        if (Value::FitsFixnum(i))
+                return (Value::Fixnum(i));
+        if (HashCons::Enabled())
+                return (HashCons::GetInstance().Int(i));
+        return (new NumExpr(i));
+}
+
+Value MakeReal(double d)
+{
+
+        if (HashCons::Enabled())
+                return (HashCons::GetInstance().Real(d));
+        return (new NumExpr(d));
+}
+
+Value MakeNumber(const Number& n)
+{
+
+        if (n.exact)
+                return (MakeInt(n.i));
+        return (MakeReal(n.d));
+}
+
+// The string e, or the one with its characters when hash-consing.
+Value ShareString(const StrExpr *e)
+{
+
+        if (HashCons::Enabled())
+                return (HashCons::GetInstance().String(e));
+        return (e);
+}
+
+Value MakeString(const string& s)
+{
+
+        return (ShareString(new StrExpr(s)));
+}
+
+// A string read, whose characters are shared with the same ones read before.
+Value MakeLiteral(const string& s)
+{
+
+        if (HashCons::Enabled())
+                return (MakeString(s));
+        return (HashCons::GetInstance().Literal(s));
+}
+
+const PairExpr *Cons(Value first, Value second)
+{
+
+        if (HashCons::Enabled())
+                return (HashCons::GetInstance().Pair(first, second));
+        return (new PairExpr(first, second));
+}
+
+// Integer arithmetic overflowing 64 bits falls back to reals.
+Number Add(const Number& a, const Number& b)
+{
+        int64_t r;
+
+        if (a.exact && b.exact && !__builtin_add_overflow(a.i, b.i, &r))
+                return (Number::Int(r));
+        return (Number::Real(a.ToReal() + b.ToReal()));
+}
+
+Number Sub(const Number& a, const Number& b)
+{
+        int64_t r;
+
+        if (a.exact && b.exact && !__builtin_sub_overflow(a.i, b.i, &r))
+                return (Number::Int(r));
+        return (Number::Real(a.ToReal() - b.ToReal()));
+}
+
+Number Mul(const Number& a, const Number& b)
+{
+        int64_t r;
+
+        if (a.exact && b.exact && !__builtin_mul_overflow(a.i, b.i, &r))
+                return (Number::Int(r));
+        return (Number::Real(a.ToReal() * b.ToReal()));
+}
+
+// The quotient of two integers stays exact when the division is.
+Number Div(const Number& n, const Number& d)
+{
+
+        if ((d.exact && d.i == 0) || (!d.exact && d.d == 0.0))
+                throw LispException("/: Division by zero.");
+
+        // INT64_MIN / -1 overflows, and so traps, even as a remainder.
+        if (n.exact && d.exact && !(n.i == INT64_MIN && d.i == -1) &&
+            n.i % d.i == 0)
+                return (Number::Int(n.i / d.i));
+        return (Number::Real(n.ToReal() / d.ToReal()));
+}
+
+// Returns a negative, zero or positive value as a < b, a == b or a > b.
+int Compare(const Number& a, const Number& b)
+{
+
+        if (a.exact && b.exact)
+                return (a.i < b.i ? -1 : a.i > b.i);
+
+        double x = a.ToReal();
+        double y = b.ToReal();
+        return (x < y ? -1 : x > y);
+}
+
+const SymbolExpr *SymbolCast(Value e)
+{
+
+        if (!e.IsSymbol())
+                throw LispException("Not a symbol: " + e.ToString());
+
+        return (e.AsSymbol());
+}
+
+Value PrimPlus(vector<Value>& args)
+{
+        // Fixnums have 61 bits, their sum can't overflow an int64.
+        if (args.size() == 2 && args[0].IsFixnum() && args[1].IsFixnum())
+                return (MakeInt(args[0].AsFixnum() + args[1].AsFixnum()));
+
+        auto acc = Number::Int(0);
+
+        for (auto e: args)
+                acc = Add(acc, NumCast(e));
+
+        return (MakeNumber(acc));
+}
+
+Value PrimMinus(vector<Value>& args)
+{
+        if (args.size() == 0)
+                throw LispException("-: Expects at least one argument.");
+
+        if (args.size() == 2 && args[0].IsFixnum() && args[1].IsFixnum())
+                return (MakeInt(args[0].AsFixnum() - args[1].AsFixnum()));
+
+        auto acc = NumCast(args[0]);
+        if (args.size() == 1)
+                return (MakeNumber(Sub(Number::Int(0), acc)));
+
+        for (size_t i = 1; i < args.size(); i++)
+                acc = Sub(acc, NumCast(args[i]));
+
+        return (MakeNumber(acc));
+}
+
+Value PrimMul(vector<Value>& args)
+{
+        int64_t r;
+
+        // Unlike their sum, the product of two fixnums can overflow.
+        if (args.size() == 2 && args[0].IsFixnum() && args[1].IsFixnum() &&
+            !__builtin_mul_overflow(args[0].AsFixnum(), args[1].AsFixnum(),
+                                    &r))
+                return (MakeInt(r));
+
+        auto acc = Number::Int(1);
+
+        for (auto e: args)
+                acc = Mul(acc, NumCast(e));
+
+        return (MakeNumber(acc));
+}
+
+Value PrimDiv(vector<Value>& args)
+{
+        if (args.size() == 0)
+                throw LispException("/: Expects at least one argument.");
+
+        auto acc = NumCast(args[0]);
+        if (args.size() == 1)
+                return (MakeNumber(Div(Number::Int(1), acc)));
+
+        for (size_t i = 1; i < args.size(); i++)
+                acc = Div(acc, NumCast(args[i]));
+
+        return (MakeNumber(acc));
+}
+
+Value PrimCons(vector<Value>& args)
+{
+        AssertArgsNum("CONS", args, 2);
+        return (Cons(args[0], args[1]));
+}
+
+const PairExpr *PairCast(Value e)
+{
+
+        if (e.Type() != ExprKind::Pair)
+                throw LispException("Not a pair: " + e.ToString());
+
+        return (e.AsPair());
+}
+
+Value PrimCar(vector<Value>& args)
+{
+        AssertArgsNum("CAR", args, 1);
+        return (PairCast(args[0])->First());
+}
+
+Value PrimCdr(vector<Value>& args)
+{
+        AssertArgsNum("CDR", args, 1);
+        return (PairCast(args[0])->Second());
+}
+
+Value
+IsType(const string& name,
+       vector<Value>& args,
+       ExprKind kind)
+{
+        AssertArgsNum(name, args, 1);
+        if (args[0].Type() == kind)
+                return (kTrue);
+        return (kNil);
+}
+
+Value PrimIsNum(vector<Value>& args)
+{
+
+        return (IsType("NUMBER?", args, ExprKind::Num));
+}
+
+Value PrimIsSym(vector<Value>& args)
+{
+
+        return (IsType("SYMBOL?", args, ExprKind::Symbol));
+}
+
+Value PrimIsList(vector<Value>& args)
+{
+
+        return (IsType("LIST?", args, ExprKind::Pair));
+}
+
+Value PrimIsNil(vector<Value>& args)
+{
+
+        return (IsType("NIL?", args, ExprKind::Nil));
+}
+
+Value PrimIsAnd(vector<Value>& args)
+{
+        AssertArgsNum("AND?", args, 2);
+        if (!args[0].IsNil() &&
+            !args[1].IsNil())
+                return (kTrue);
+        return (kNil);
+}
+
+Value PrimIsOr(vector<Value>& args)
+{
+        AssertArgsNum("OR?", args, 2);
+        if (args[0].IsNil() &&
+            args[1].IsNil())
+                return (kNil);
+        return (kTrue);
+}
+
+Value PrimIsEq(vector<Value>& args)
+{
+        AssertArgsNum("EQ?", args, 2);
+
+        if (args[0] == args[1] ||
+            (args[0].Type() == ExprKind::Num &&
+             args[1].Type() == ExprKind::Num &&
+             Compare(NumCast(args[0]), NumCast(args[1])) == 0))
+                return (kTrue);
+        return (kNil);
+}
+
+// Fixnums compare as they are, without being unboxed.
+int CompareArgs(const string& name, vector<Value>& args)
+{
+        AssertArgsNum(name, args, 2);
+
+        if (args[0].IsFixnum() && args[1].IsFixnum()) {
+                auto a = args[0].AsFixnum();
+                auto b = args[1].AsFixnum();
+                return (a < b ? -1 : a > b);
+        }
+
+        auto a = NumCast(args[0]);
+        auto b = NumCast(args[1]);
+        return (Compare(a, b));
+}
+
+Value PrimIsEqNum(vector<Value>& args)
+{
+
+        if (CompareArgs("=", args) == 0)
+                return (kTrue);
+        return (kNil);
+}
+
+Value PrimIsLtNum(vector<Value>& args)
+{
+
+        if (CompareArgs("<", args) < 0)
+                return (kTrue);
+        return (kNil);
+}
+
+Value PrimIsGtNum(vector<Value>& args)
+{
+
+        if (CompareArgs(">", args) > 0)
+                return (kTrue);
+        return (kNil);
+}
+
+Value PrimMemoize(vector<Value>& args)
+{
+        static const size_t kDefaultCapacity = 1024;
+        size_t capacity = kDefaultCapacity;
+
+        if (args.size() != 1 && args.size() != 2)
+                throw LispException("MEMOIZE: Wrong number of arguments.");
+        if (args[0].Type() != ExprKind::Function &&
+            args[0].Type() != ExprKind::Primitive)
+                throw LispException("Not a procedure: " + args[0].ToString());
+        if (args.size() == 2) {
+                if (!args[1].IsFixnum() || args[1].AsFixnum() < 1)
+                        throw LispException("MEMOIZE: Not a positive size: " +
+                                            args[1].ToString());
+                capacity = args[1].AsFixnum();
+        }
+
+        return (new MemoExpr(args[0], capacity));
+}
+
+// Returns the list (hits misses size capacity) of a memoized procedure.
+Value PrimMemoStats(vector<Value>& args)
+{
+        AssertArgsNum("MEMO-STATS", args, 1);
+        if (args[0].Type() != ExprKind::Memo)
+                throw LispException("Not a memoized procedure: " +
+                                    args[0].ToString());
+
+        auto stats = static_cast<const MemoExpr *>(
+                args[0].AsObject())->Stats();
+        Value l = kNil;
+        for (size_t i = stats.size(); i-- > 0; )
+                l = Cons(MakeInt(stats[i]), l);
+
+        return (l);
+}
+
+// Waits for the value of a future, any other value is its own.
+Value PrimTouch(vector<Value>& args)
+{
+        AssertArgsNum("TOUCH", args, 1);
+        if (args[0].Type() != ExprKind::Future)
+                return (args[0]);
+        return (static_cast<const FutureExpr *>(args[0].AsObject())->Touch());
+}
+
+// The lanes of the widest SIMD registers the build targets: four doubles
+// with AVX2, two with SSE2, or a single one.  The vector primitives are
+// written once on top of these operations.
+struct Lanes {
+#if defined(__AVX2__)
+        typedef __m256d V;
+        static const size_t kWidth = 4;
+
+        static V Load(const double *p) { return (_mm256_loadu_pd(p)); }
+        static void Store(double *p, V v) { _mm256_storeu_pd(p, v); }
+        static V Splat(double d) { return (_mm256_set1_pd(d)); }
+        static V Add(V a, V b) { return (_mm256_add_pd(a, b)); }
+        static V Sub(V a, V b) { return (_mm256_sub_pd(a, b)); }
+        static V Mul(V a, V b) { return (_mm256_mul_pd(a, b)); }
+        static V Div(V a, V b) { return (_mm256_div_pd(a, b)); }
+        static V Min(V a, V b) { return (_mm256_min_pd(a, b)); }
+        static V Max(V a, V b) { return (_mm256_max_pd(a, b)); }
+
+        // The comparisons give 1 where they hold, 0 elsewhere.
+        static V Less(V a, V b)
+        {
+                return (_mm256_and_pd(_mm256_cmp_pd(a, b, _CMP_LT_OQ),
+                                      Splat(1)));
+        }
+
+        static V Greater(V a, V b)
+        {
+                return (_mm256_and_pd(_mm256_cmp_pd(a, b, _CMP_GT_OQ),
+                                      Splat(1)));
+        }
+
+        static V Equal(V a, V b)
+        {
+                return (_mm256_and_pd(_mm256_cmp_pd(a, b, _CMP_EQ_OQ),
+                                      Splat(1)));
+        }
+#elif defined(__SSE2__)
+        typedef __m128d V;
+        static const size_t kWidth = 2;
+
+        static V Load(const double *p) { return (_mm_loadu_pd(p)); }
+        static void Store(double *p, V v) { _mm_storeu_pd(p, v); }
+        static V Splat(double d) { return (_mm_set1_pd(d)); }
+        static V Add(V a, V b) { return (_mm_add_pd(a, b)); }
+        static V Sub(V a, V b) { return (_mm_sub_pd(a, b)); }
+        static V Mul(V a, V b) { return (_mm_mul_pd(a, b)); }
+        static V Div(V a, V b) { return (_mm_div_pd(a, b)); }
+        static V Min(V a, V b) { return (_mm_min_pd(a, b)); }
+        static V Max(V a, V b) { return (_mm_max_pd(a, b)); }
+
+        // The comparisons give 1 where they hold, 0 elsewhere.
+        static V Less(V a, V b)
+        {
+                return (_mm_and_pd(_mm_cmplt_pd(a, b), Splat(1)));
+        }
+
+        static V Greater(V a, V b)
+        {
+                return (_mm_and_pd(_mm_cmpgt_pd(a, b), Splat(1)));
+        }
+
+        static V Equal(V a, V b)
+        {
+                return (_mm_and_pd(_mm_cmpeq_pd(a, b), Splat(1)));
+        }
+#else
+        typedef double V;
+        static const size_t kWidth = 1;
+
+        static V Load(const double *p) { return (*p); }
+        static void Store(double *p, V v) { *p = v; }
+        static V Splat(double d) { return (d); }
+        static V Add(V a, V b) { return (a + b); }
+        static V Sub(V a, V b) { return (a - b); }
+        static V Mul(V a, V b) { return (a * b); }
+        static V Div(V a, V b) { return (a / b); }
+        // As the SIMD instructions do, b when either is a NaN.
+        static V Min(V a, V b) { return (a < b ? a : b); }
+        static V Max(V a, V b) { return (a > b ? a : b); }
+
+        // The comparisons give 1 where they hold, 0 elsewhere.
+        static V Less(V a, V b) { return (a < b ? 1 : 0); }
+        static V Greater(V a, V b) { return (a > b ? 1 : 0); }
+        static V Equal(V a, V b) { return (a == b ? 1 : 0); }
+#endif
+
+        static double First(V v)
+        {
+                double lanes[kWidth];
+
+                Store(lanes, v);
+                return (lanes[0]);
+        }
+
+        // Combines the lanes of v with op.
+        template <typename Op>
+        static double Fold(V v, Op op)
+        {
+                double lanes[kWidth];
+
+                Store(lanes, v);
+                double acc = lanes[0];
+                for (size_t i = 1; i < kWidth; i++)
+                        acc = First(op(Splat(acc), Splat(lanes[i])));
+                return (acc);
+        }
+};
+
+// out[i] = op(a[i], b[i]).  The elements left over by the lanes are done
+// one at a time, splatted.
+template <typename Op>
+void MapLanes(const double *a, const double *b, double *out, size_t n, Op op)
+{
+        size_t i = 0;
+
+        for (; i + Lanes::kWidth <= n; i += Lanes::kWidth)
+                Lanes::Store(out + i, op(Lanes::Load(a + i),
+                                         Lanes::Load(b + i)));
+        for (; i < n; i++)
+                out[i] = Lanes::First(op(Lanes::Splat(a[i]),
+                                         Lanes::Splat(b[i])));
+}
+
+// out[i] = op(a[i], k).
+template <typename Op>
+void MapLanes(const double *a, double k, double *out, size_t n, Op op)
+{
+        auto kv = Lanes::Splat(k);
+        size_t i = 0;
+
+        for (; i + Lanes::kWidth <= n; i += Lanes::kWidth)
+                Lanes::Store(out + i, op(Lanes::Load(a + i), kv));
+        for (; i < n; i++)
+                out[i] = Lanes::First(op(Lanes::Splat(a[i]), kv));
+}
+
+// Folds a with op, from identity.
+template <typename Op>
+double FoldLanes(const double *a, size_t n, double identity, Op op)
+{
+        auto acc = Lanes::Splat(identity);
+        size_t i = 0;
+
+        for (; i + Lanes::kWidth <= n; i += Lanes::kWidth)
+                acc = op(acc, Lanes::Load(a + i));
+        double result = Lanes::Fold(acc, op);
+        for (; i < n; i++)
+                result = Lanes::First(op(Lanes::Splat(result),
+                                         Lanes::Splat(a[i])));
+        return (result);
+}
+
+const VecExpr *VecCast(const string& name, Value e)
+{
+
+        if (e.Type() != ExprKind::Vector)
+                throw LispException(name + ": Not a vector: " + e.ToString());
+        return (static_cast<const VecExpr *>(e.AsObject()));
+}
+
+// (list->vec l) is the vector of the numbers of l.
+Value PrimListToVec(vector<Value>& args)
+{
+        AssertArgsNum("LIST->VEC", args, 1);
+
+        size_t n = 0;
+        for (auto l = args[0]; !l.IsNil(); l = PairCast(l)->Second())
+                n++;
+        auto v = VecExpr::Make(n);
+        auto d = v->Data();
+        for (auto l = args[0]; !l.IsNil(); l = l.AsPair()->Second())
+                *d++ = NumCast(l.AsPair()->First()).ToReal();
+
+        return (v);
+}
+
+// (vec-range start end [step]) is the vector of start, start + step, ...
+// up to end excluded.
+Value PrimVecRange(vector<Value>& args)
+{
+        if (args.size() != 2 && args.size() != 3)
+                throw LispException("VEC-RANGE: Wrong number of arguments.");
+
+        double start = NumCast(args[0]).ToReal();
+        double end = NumCast(args[1]).ToReal();
+        double step = args.size() == 3 ? NumCast(args[2]).ToReal() : 1;
+        if (step == 0 || step != step)
+                throw LispException("VEC-RANGE: Not a valid step: " +
+                                    args[2].ToString());
+
+        double count = std::ceil((end - start) / step);
+        if (!(count < static_cast<double>(SIZE_MAX)))
+                throw LispException("VEC-RANGE: Too many elements.");
+        size_t n = count > 0 ? static_cast<size_t>(count) : 0;
+        auto v = VecExpr::Make(n);
+        for (size_t i = 0; i < n; i++)
+                v->Data()[i] = start + i * step;
+
+        return (v);
+}
+
+Value PrimVecToList(vector<Value>& args)
+{
+        AssertArgsNum("VEC->LIST", args, 1);
+
+        auto v = VecCast("VEC->LIST", args[0]);
+        Value l = kNil;
+        for (size_t i = v->Size(); i-- > 0; )
+                l = Cons(MakeReal(v->Data()[i]), l);
+
+        return (l);
+}
+
+Value PrimVecLength(vector<Value>& args)
+{
+        AssertArgsNum("VEC-LENGTH", args, 1);
+        return (MakeInt(VecCast("VEC-LENGTH", args[0])->Size()));
+}
+
+Value PrimVecRef(vector<Value>& args)
+{
+        AssertArgsNum("VEC-REF", args, 2);
+
+        auto v = VecCast("VEC-REF", args[0]);
+        if (!args[1].IsFixnum() || args[1].AsFixnum() < 0 ||
+            static_cast<size_t>(args[1].AsFixnum()) >= v->Size())
+                throw LispException("VEC-REF: Index out of range: " +
+                                    args[1].ToString());
+
+        return (MakeReal(v->Data()[args[1].AsFixnum()]));
+}
+
+Value PrimIsVec(vector<Value>& args)
+{
+
+        return (IsType("VEC?", args, ExprKind::Vector));
+}
+
+// Applies op to the elements of two vectors of the same size, or of a
+// vector and a number.
+template <typename Op>
+Value VecMap(const string& name, vector<Value>& args, Op op)
+{
+        AssertArgsNum(name, args, 2);
+
+        bool a_vec = args[0].Type() == ExprKind::Vector;
+        bool b_vec = args[1].Type() == ExprKind::Vector;
+        if (!a_vec && !b_vec)
+                throw LispException(name + ": Not a vector: " +
+                                    args[0].ToString());
+
+        auto a = a_vec ? VecCast(name, args[0]) : NULL;
+        auto b = b_vec ? VecCast(name, args[1]) : NULL;
+        if (a_vec && b_vec && a->Size() != b->Size())
+                throw LispException(name + ": Vectors of different sizes.");
+
+        size_t n = a_vec ? a->Size() : b->Size();
+        auto out = VecExpr::Make(n);
+        if (a_vec && b_vec)
+                MapLanes(a->Data(), b->Data(), out->Data(), n, op);
+        else if (a_vec)
+                MapLanes(a->Data(), NumCast(args[1]).ToReal(), out->Data(),
+                         n, op);
+        else
+                MapLanes(b->Data(), NumCast(args[0]).ToReal(), out->Data(),
+                         n, [op](Lanes::V x, Lanes::V k) {
+                                return (op(k, x));
+                        });
+
+        return (out);
+}
+
+Value PrimVecAdd(vector<Value>& args)
+{
+
+        return (VecMap("VEC+", args, Lanes::Add));
+}
+
+Value PrimVecSub(vector<Value>& args)
+{
+
+        return (VecMap("VEC-", args, Lanes::Sub));
+}
+
+Value PrimVecMul(vector<Value>& args)
+{
+
+        return (VecMap("VEC*", args, Lanes::Mul));
+}
+
+Value PrimVecDiv(vector<Value>& args)
+{
+
+        return (VecMap("VEC/", args, Lanes::Div));
+}
+
+Value PrimVecLess(vector<Value>& args)
+{
+
+        return (VecMap("VEC<", args, Lanes::Less));
+}
+
+Value PrimVecGreater(vector<Value>& args)
+{
+
+        return (VecMap("VEC>", args, Lanes::Greater));
+}
+
+Value PrimVecEqual(vector<Value>& args)
+{
+
+        return (VecMap("VEC=", args, Lanes::Equal));
+}
+
+// (vec-scale v k) multiplies each element of v by k.
+Value PrimVecScale(vector<Value>& args)
+{
+        AssertArgsNum("VEC-SCALE", args, 2);
+        VecCast("VEC-SCALE", args[0]);
+        NumCast(args[1]);
+
+        return (VecMap("VEC-SCALE", args, Lanes::Mul));
+}
+
+Value PrimVecSum(vector<Value>& args)
+{
+        AssertArgsNum("VEC-SUM", args, 1);
+
+        auto v = VecCast("VEC-SUM", args[0]);
+        return (MakeReal(FoldLanes(v->Data(), v->Size(), 0, Lanes::Add)));
+}
+
+Value PrimVecMin(vector<Value>& args)
+{
+        AssertArgsNum("VEC-MIN", args, 1);
+
+        auto v = VecCast("VEC-MIN", args[0]);
+        if (v->Size() == 0)
+                throw LispException("VEC-MIN: Empty vector.");
+        return (MakeReal(FoldLanes(v->Data(), v->Size(), v->Data()[0],
+                                   Lanes::Min)));
+}
+
+Value PrimVecMax(vector<Value>& args)
+{
+        AssertArgsNum("VEC-MAX", args, 1);
+
+        auto v = VecCast("VEC-MAX", args[0]);
+        if (v->Size() == 0)
+                throw LispException("VEC-MAX: Empty vector.");
+        return (MakeReal(FoldLanes(v->Data(), v->Size(), v->Data()[0],
+                                   Lanes::Max)));
+}
+
+Value PrimVecDot(vector<Value>& args)
+{
+        AssertArgsNum("VEC-DOT", args, 2);
+
+        auto a = VecCast("VEC-DOT", args[0]);
+        auto b = VecCast("VEC-DOT", args[1]);
+        if (a->Size() != b->Size())
+                throw LispException("VEC-DOT: Vectors of different sizes.");
+
+        auto acc = Lanes::Splat(0);
+        size_t n = a->Size();
+        size_t i = 0;
+        for (; i + Lanes::kWidth <= n; i += Lanes::kWidth)
+                acc = Lanes::Add(acc, Lanes::Mul(Lanes::Load(a->Data() + i),
+                                                 Lanes::Load(b->Data() + i)));
+        double dot = Lanes::Fold(acc, Lanes::Add);
+        for (; i < n; i++)
+                dot += a->Data()[i] * b->Data()[i];
+
+        return (MakeReal(dot));
+}
+
+const HashExpr *HashCast(const string& name, Value e)
+{
+
+        if (e.Type() != ExprKind::Hash)
+                throw LispException(name + ": Not a hash table: " +
+                                    e.ToString());
+        return (static_cast<const HashExpr *>(e.AsObject()));
+}
+
+// (make-hash [capacity]) is an empty table, with room for capacity entries
+// before it grows.
+Value PrimMakeHash(vector<Value>& args)
+{
+        if (args.size() > 1)
+                throw LispException("MAKE-HASH: Wrong number of arguments.");
+
+        int64_t capacity = 0;
+        if (!args.empty()) {
+                if (!args[0].IsFixnum() || args[0].AsFixnum() < 0 ||
+                    args[0].AsFixnum() > INT64_C(1) << 40)
+                        throw LispException("MAKE-HASH: Not a valid "
+                                            "capacity: " + args[0].ToString());
+                capacity = args[0].AsFixnum();
+        }
+
+        return (new HashExpr(capacity));
+}
+
+// (hash-get table key [default]) is the value of key in table, or default
+// (NIL by default) if there is none.
+Value PrimHashGet(vector<Value>& args)
+{
+        if (args.size() != 2 && args.size() != 3)
+                throw LispException("HASH-GET: Wrong number of arguments.");
+
+        Value value;
+        if (HashCast("HASH-GET", args[0])->Get(args[1], value))
+                return (value);
+        return (args.size() == 3 ? args[2] : kNil);
+}
+
+// (hash-set! table key value) binds key to value in table, and returns
+// value.
+Value PrimHashSet(vector<Value>& args)
+{
+        AssertArgsNum("HASH-SET!", args, 3);
+
+        HashCast("HASH-SET!", args[0])->Set(args[1], args[2]);
+        return (args[2]);
+}
+
+// (hash-remove! table key) removes the entry of key, and returns whether
+// there was one.
+Value PrimHashRemove(vector<Value>& args)
+{
+        AssertArgsNum("HASH-REMOVE!", args, 2);
+
+        return (HashCast("HASH-REMOVE!", args[0])->Remove(args[1]) ? kTrue :
+                kNil);
+}
+
+Value PrimHashCount(vector<Value>& args)
+{
+        AssertArgsNum("HASH-COUNT", args, 1);
+        return (MakeInt(HashCast("HASH-COUNT", args[0])->Count()));
+}
+
+Value PrimHashKeys(vector<Value>& args)
+{
+        AssertArgsNum("HASH-KEYS", args, 1);
+
+        auto entries = HashCast("HASH-KEYS", args[0])->Entries();
+        Value l = kNil;
+        for (size_t i = 0; i < entries.size(); i += 2)
+                l = Cons(entries[i], l);
+
+        return (l);
+}
+
+// (hash->list table) is the list of the entries of table, as pairs of a key
+// and its value, in no particular order.
+Value PrimHashToList(vector<Value>& args)
+{
+        AssertArgsNum("HASH->LIST", args, 1);
+
+        auto entries = HashCast("HASH->LIST", args[0])->Entries();
+        Value l = kNil;
+        for (size_t i = 0; i < entries.size(); i += 2)
+                l = Cons(Cons(entries[i], entries[i + 1]), l);
+
+        return (l);
+}
+
+Value PrimIsHash(vector<Value>& args)
+{
+
+        return (IsType("HASH?", args, ExprKind::Hash));
+}
+
+const StrExpr *StrCast(const string& name, Value e)
+{
+
+        if (e.Type() != ExprKind::String)
+                throw LispException(name + ": Not a string: " + e.ToString());
+        return (static_cast<const StrExpr *>(e.AsObject()));
+}
+
+Value PrimIsString(vector<Value>& args)
+{
+
+        return (IsType("STRING?", args, ExprKind::String));
+}
+
+Value PrimStringLength(vector<Value>& args)
+{
+        AssertArgsNum("STRING-LENGTH", args, 1);
+        return (MakeInt(StrCast("STRING-LENGTH", args[0])->Size()));
+}
+
+// (substring s start [end]) is the string of the characters of s from
+// start to end excluded, or to the end of s.  They are not copied.
+Value PrimSubstring(vector<Value>& args)
+{
+        if (args.size() != 2 && args.size() != 3)
+                throw LispException("SUBSTRING: Wrong number of arguments.");
+
+        auto s = StrCast("SUBSTRING", args[0]);
+        int64_t bounds[2] = {0, static_cast<int64_t>(s->Size())};
+        for (size_t i = 1; i < args.size(); i++) {
+                if (!args[i].IsFixnum() || args[i].AsFixnum() < bounds[0] ||
+                    args[i].AsFixnum() > static_cast<int64_t>(s->Size()))
+                        throw LispException("SUBSTRING: Index out of range: " +
+                                            args[i].ToString());
+                bounds[i - 1] = args[i].AsFixnum();
+        }
+
+        return (ShareString(s->Slice(bounds[0], bounds[1])));
+}
+
+// (string-append s...) is the string of the characters of the strings one
+// after the other.  Appending to the last string appended to is amortized,
+// see StrExpr::Append.
+Value PrimStringAppend(vector<Value>& args)
+{
+        vector<const StrExpr *> parts;
+
+        for (auto e: args)
+                parts.push_back(StrCast("STRING-APPEND", e));
+        if (parts.empty())
+                return (MakeString(""));
+        if (parts.size() == 1)
+                return (args[0]);
+        auto first = parts[0];
+        parts.erase(parts.begin());
+
+        return (ShareString(first->Append(parts)));
+}
+
+Value PrimStringEqual(vector<Value>& args)
+{
+        AssertArgsNum("STRING=", args, 2);
+
+        StrCast("STRING=", args[0]);
+        StrCast("STRING=", args[1]);
+        return (SameValue(args[0], args[1]) ? kTrue : kNil);
+}
+
+// (string-split s separator) is the list of the parts of s between the
+// occurrences of separator, not copied.
+Value PrimStringSplit(vector<Value>& args)
+{
+        AssertArgsNum("STRING-SPLIT", args, 2);
+
+        auto s = StrCast("STRING-SPLIT", args[0]);
+        auto sep = StrCast("STRING-SPLIT", args[1]);
+        if (sep->Size() == 0)
+                throw LispException("STRING-SPLIT: Empty separator.");
+
+        // Where each part starts, and the end of s after the last one.
+        vector<size_t> starts(1, 0);
+        auto begin = s->Data(), end = begin + s->Size();
+        for (auto p = begin; ; p += sep->Size()) {
+                p = std::search(p, end, sep->Data(),
+                                sep->Data() + sep->Size());
+                if (p == end)
+                        break;
+                starts.push_back(p - begin + sep->Size());
+        }
+        starts.push_back(s->Size() + sep->Size());
+
+        Value l = kNil;
+        for (size_t i = starts.size() - 1; i-- > 0; )
+                l = Cons(ShareString(s->Slice(starts[i],
+                                              starts[i + 1] - sep->Size())),
+                         l);
+        return (l);
+}
+
+// (string-join list [separator]) is the string of the strings of list, with
+// separator between them.
+Value PrimStringJoin(vector<Value>& args)
+{
+        if (args.size() != 1 && args.size() != 2)
+                throw LispException("STRING-JOIN: Wrong number of arguments.");
+
+        auto sep = args.size() == 2 ? StrCast("STRING-JOIN", args[1]) : NULL;
+        vector<const StrExpr *> parts;
+        for (auto l = args[0]; !l.IsNil(); l = PairCast(l)->Second()) {
+                if (sep != NULL && !parts.empty())
+                        parts.push_back(sep);
+                parts.push_back(StrCast("STRING-JOIN",
+                                        l.AsPair()->First()));
+        }
+        if (parts.empty())
+                return (MakeString(""));
+        auto first = parts[0];
+        parts.erase(parts.begin());
+
+        return (ShareString(first->Append(parts)));
+}
+
+// An input stream reading a file descriptor, e.g. a pipe or a socket.  A
+// read returns what is available, so the forms can be evaluated as they
+// arrive.
+//
+// What is written is buffered until the buffer is full, the stream is
+// flushed or the input runs dry: before waiting for more input, the answers
+// to all the input already received go out in a single write.
+class FdBuf : public std::streambuf {
+public:
+        explicit FdBuf(FdBuf const&)            = delete;
+        void operator=(FdBuf const&)            = delete;
+
+        explicit FdBuf(int fd) : fd_(fd) { setp(out_, out_ + sizeof(out_)); }
+
+        ~FdBuf() { sync(); }
+protected:
+        virtual int_type underflow()
+        {
+                ssize_t n;
+
+                if (sync() != 0)
+                        return (traits_type::eof());
+                do
+                        n = read(fd_, buf_, sizeof(buf_));
+                while (n < 0 && errno == EINTR);
+                if (n <= 0)
+                        return (traits_type::eof());
+                setg(buf_, buf_, buf_ + n);
+                return (traits_type::to_int_type(buf_[0]));
+        }
+
+        virtual int_type overflow(int_type c)
+        {
+                if (sync() != 0)
+                        return (traits_type::eof());
+                if (!traits_type::eq_int_type(c, traits_type::eof())) {
+                        *pptr() = traits_type::to_char_type(c);
+                        pbump(1);
+                }
+                return (traits_type::not_eof(c));
+        }
+
+        virtual int sync()
+        {
+                const char *p = pbase();
+
+                while (p < pptr()) {
+                        ssize_t n = write(fd_, p, pptr() - p);
+                        if (n < 0 && errno == EINTR)
+                                continue;
+                        if (n < 0)
+                                return (-1);
+                        p += n;
+                }
+                setp(out_, out_ + sizeof(out_));
+                return (0);
+        }
+private:
+        const int fd_;
+        char buf_[4096];
+        char out_[4096];
+};
+
+// Reads the forms of an input one at a time.  The input is pulled a line at
+// a time as a form needs it, so a form may span several lines and the ones
+// read can be evaluated before the rest of the input has arrived.  Only the
+// line of the token being scanned is buffered.
+class Reader {
+public:
+        explicit Reader(Reader const&)          = delete;
+        void operator=(Reader const&)           = delete;
+
+        // The prompt, if any, is written whenever a line is read while no
+        // form is begun.
+        explicit Reader(std::istream& is, std::ostream *prompt = NULL) :
+                is_(is), prompt_(prompt), pos_(0), start_(0), eof_(false),
+                in_form_(false), peeked_(false)
+        {}
+
+        // Reads the next form into e.  Returns false at the end of the
+        // input.
+        bool Read(Value& e)
+        {
+
+                in_form_ = false;
+                if (!Peek())
+                        return (false);
+                e = ParseExpr();
+                return (true);
+        }
+
+        // Reads a line starting with '!', a command to the REPL, between
+        // the forms.
+        bool Command(string& command)
+        {
+                in_form_ = false;
+                if (peeked_ || SkipSpace() != '!')
+                        return (false);
+                int c;
+                start_ = pos_;
+                while ((c = Char()) != EOF && c != '\n')
+                        pos_++;
+                command = buf_.substr(start_, pos_ - start_);
+                start_ = pos_;
+                return (true);
+        }
+
+        // Whether nothing but blanks follows the forms read on the line.
+        bool AtLineEnd() const
+        {
+                if (peeked_)
+                        return (false);
+                for (size_t i = pos_; i < buf_.size(); i++)
+                        if (!isspace(static_cast<unsigned char>(buf_[i])))
+                                return (false);
+                return (true);
+        }
+
+        // Drops what is left of the line read, after an error.
+        void Discard()
+        {
+                buf_.clear();
+                pos_ = start_ = 0;
+                peeked_ = false;
+        }
+private:
+        // The text of a token is a view of the buffer, valid until the next
+        // token is scanned.
+        struct Token {
+                TokenKind kind;
+                const char *text;
+                size_t size;
+
+                string Str() const { return (string(text, size)); }
+        };
+
+        // The current character, EOF at the end of the input.
+        int Char()
+        {
+
+                if (pos_ == buf_.size() && !Fill())
+                        return (EOF);
+                return (static_cast<unsigned char>(buf_[pos_]));
+        }
+
+        // Appends the next line to the buffer, keeping the token being
+        // scanned from start_ on.
+        bool Fill()
+        {
+                string line;
+
+                if (eof_)
+                        return (false);
+                buf_.erase(0, start_);
+                pos_ -= start_;
+                start_ = 0;
+                if (prompt_ != NULL && !in_form_)
+                        *prompt_ << "> " << std::flush;
+                if (!std::getline(is_, line)) {
+                        eof_ = true;
+                        return (false);
+                }
+                buf_ += line;
+                buf_ += '\n';
+                return (true);
+        }
+
+        int SkipSpace()
+        {
+                int c;
+
+                for (;;) {
+                        start_ = pos_;
+                        c = Char();
+                        if (c == EOF || !isspace(c))
+                                return (c);
+                        pos_++;
+                }
+        }
+
+        static bool IsSeparator(int c)
+        {
+                return (c == EOF || isspace(c) || c == '(' || c == ')' ||
+                        c == '"' || c == '\'');
+        }
+
+        // A number with a dot is a real, an integer otherwise.
+        static bool IsNumber(const char *s, size_t n, bool& hasDot)
+        {
+                size_t i;
+
+                i = 0;
+                if (!isdigit(s[i]) &&
+                    !(s[i] == '-' && i+1 < n && isdigit(s[i+1])))
+                        return (false);
+
+                hasDot = false;
+                while (++i < n)
+                        if (!isdigit(s[i])) {
+                                if (s[i] == '.' && !hasDot)
+                                        hasDot = true;
+                                else
+                                        return (false);
+                        }
+
+                return (true);
+        }
+
+        // Scans the next token into token_.  Returns false at the end of the
+        // input.
+        bool Scan()
+        {
+                int c = SkipSpace();
+
+                if (c == EOF)
+                        return (false);
+
+                in_form_ = true;
+                switch (c) {
+                case '"':
+                        pos_++;
+                        while ((c = Char()) != EOF && c != '"')
+                                pos_++;
+                        if (c == EOF)
+                                throw LispException("Unmatched string quote.");
+                        pos_++;
+                        token_ = {TokenKind::String, &buf_[start_ + 1],
+                                  pos_ - start_ - 2};
+                        return (true);
+                case '(':
+                        pos_++;
+                        // Check for "()" as a special case.
+                        if (Char() == ')') {
+                                pos_++;
+                                token_ = {TokenKind::Nil, "()", 2};
+                        } else
+                                token_ = {TokenKind::BeginParenthesis, "(", 1};
+                        return (true);
+                case ')':
+                        pos_++;
+                        token_ = {TokenKind::EndParenthesis, ")", 1};
+                        return (true);
+                case '\'':
+                        pos_++;
+                        token_ = {TokenKind::Quote, "'", 1};
+                        return (true);
+                default:
+                        while (!IsSeparator(Char()))
+                                pos_++;
+                        break;
+                }
+
+                const char *text = &buf_[start_];
+                size_t size = pos_ - start_;
+                bool isReal;
+                if (IsNumber(text, size, isReal))
+                        token_ = {isReal ? TokenKind::Real :
+                                  TokenKind::Integer, text, size};
+                else if (size == 1 && (*text == 't' || *text == 'T'))
+                        token_ = {TokenKind::True, text, size};
+                else
+                        token_ = {TokenKind::Symbol, text, size};
+                return (true);
+        }
+
+        // Returns the next token without consuming it, NULL at the end of
+        // the input.
+        const Token *Peek()
+        {
+
+                if (!peeked_)
+                        peeked_ = Scan();
+                return (peeked_ ? &token_ : NULL);
+        }
+
+        const Token& Next()
+        {
+
+                if (Peek() == NULL)
+                        throw LispException("Unexpected end of the input.");
+                peeked_ = false;
+                return (token_);
+        }
+
+        Value ParseAtom(const Token& t)
+        {
+
+                switch (t.kind) {
+                case TokenKind::Integer:
+                        try {
+                                return (MakeInt(std::stoll(t.Str())));
+                        } catch (const std::out_of_range&) {
+                                // Too large for 64 bits, read it as a real.
+                                return (MakeReal(std::stod(t.Str())));
+                        }
+                        break;
+                case TokenKind::Real:
+                        return (MakeReal(std::stod(t.Str())));
+                        break;
+                case TokenKind::String:
+                        return (MakeLiteral(t.Str()));
+                        break;
+                case TokenKind::Nil:
+                        return (kNil);
+                        break;
+                case TokenKind::Symbol:
+                        return (Value::Symbol(
+                                        SymbolExpr::GetInstance(t.Str())));
+                        break;
+                case TokenKind::True:
+                        return (kTrue);
+                        break;
+                default:
+                        throw LispException(
+                                "Unexpected kind: " + t.Str());
+                        break;
+                }
+        }
+
+        // The lists and the quotes being parsed are kept on a stack of
+        // their own rather than the C++ one, so neither the length nor the
+        // depth of an expression is limited.  No collection can happen
+        // while parsing, the elements need no rooting.
+        Value ParseExpr()
+        {
+                open_.clear();
+                elems_.clear();
+
+                for (;;) {
+                        if (Peek() == NULL)
+                                throw LispException(
+                                        !open_.empty() && !open_.back().quote &&
+                                        elems_.size() > open_.back().start ?
+                                        "Missing closing ')'." :
+                                        "Unexpected end of the input.");
+
+                        auto& t = Next();
+                        Value e;
+                        switch (t.kind) {
+                        case TokenKind::BeginParenthesis:
+                        case TokenKind::Quote:
+                                open_.push_back({elems_.size(),
+                                                 t.kind == TokenKind::Quote});
+                                continue;
+                        case TokenKind::EndParenthesis:
+                                // A list has at least an element, "()" is
+                                // scanned as NIL.
+                                if (open_.empty() || open_.back().quote ||
+                                    elems_.size() == open_.back().start)
+                                        throw LispException(
+                                                "Unexpected kind: " + t.Str());
+                                e = kNil;
+                                for (size_t i = elems_.size();
+                                     i-- > open_.back().start; )
+                                        e = Cons(elems_[i], e);
+                                elems_.resize(open_.back().start);
+                                open_.pop_back();
+                                break;
+                        default:
+                                e = ParseAtom(t);
+                                break;
+                        }
+
+                        // The expression completes the quotes around it,
+                        // and then either an element or the whole form.
+                        for (;;) {
+                                if (open_.empty())
+                                        return (e);
+                                if (!open_.back().quote) {
+                                        elems_.push_back(e);
+                                        break;
+                                }
+                                open_.pop_back();
+                                e = Cons(Value::Symbol(
+                                                 SymbolExpr::GetInstance(
+                                                         "QUOTE")),
+                                         Cons(e, kNil));
+                        }
+                }
+        }
+
+        // A list or a quote begun: where its elements start in elems_.
+        struct Open {
+                size_t start;
+                bool quote;
+        };
+
+        std::istream& is_;
+        std::ostream *prompt_;
+        string buf_;
+        // The position of the scanner and the start of the token it scans.
+        size_t pos_;
+        size_t start_;
+        bool eof_;
+        // Whether a form is being read, i.e. no prompt is due.
+        bool in_form_;
+        bool peeked_;
+        Token token_;
+        vector<Open> open_;
+        vector<Value> elems_;
+};
+
+// How the interpreter runs the expressions: by walking their trees, the
+// reference, or by compiling them to bytecode first.
+enum class Engine { Tree, Bytecode };
+
+// A heap image holds the global bindings of an interpreter and the data they
+// reach, so that an interpreter can start from them without reading and
+// evaluating again the prelude that built them.  It is a sequence of words:
+// a header, the names of the symbols, the objects, each after the ones it
+// refers to, and the bindings.  A reference is an index in the symbols or
+// the objects rather than an address, in a word tagged as a Value is, so the
+// image can be loaded anywhere.  The words are those of the machine that
+// wrote it.
+//
+// A hash table may refer to itself, so the tables are written empty and their
+// entries after the objects: the table, the number of entries, and the key
+// and the value of each.
+const uint64_t kImageMagic = UINT64_C(0x02474d4950534959);     // YISPIMG\2
+
+enum class ImageRecord : uint64_t {
+        Pair,           // first, second
+        String,         // length, characters
+        Int,            // integer
+        Real,           // bits of the double
+        Function,       // name, number of parameters, parameters, body, code
+        Local,          // slot, name
+        Primitive,      // length, characters of the printed name
+        Memo,           // function, capacity
+        Vector,         // length, bits of each double
+        Hash,           // capacity
+};
+
+const uint64_t kSymbolRef = 2;
+const uint64_t kObjectRef = 4;
+
+class ImageWriter {
+public:
+        explicit ImageWriter(ImageWriter const&)        = delete;
+        void operator=(ImageWriter const&)              = delete;
+
+        explicit ImageWriter() {}
+
+        void Bind(const SymbolExpr *s, Value e)
+        {
+                Add(e);
+                cells_.push_back(Symbol(s));
+                cells_.push_back(Ref(e));
+        }
+
+        void Write(std::ostream& os)
+        {
+                // Writing the entries of a table may find more of them.
+                vector<uint64_t> fills;
+                for (size_t i = 0; i < tables_.size(); i++) {
+                        auto entries = static_cast<const HashExpr *>(
+                                tables_[i].AsObject())->Entries();
+                        for (auto e: entries)
+                                Add(e);
+                        fills.push_back(Ref(tables_[i]));
+                        fills.push_back(entries.size() / 2);
+                        for (auto e: entries)
+                                fills.push_back(Ref(e));
+                }
+
+                vector<uint64_t> head = {
+                        kImageMagic, symbols_.size(), objects_.size(),
+                        tables_.size(), cells_.size() / 2
+                };
+
+                for (auto s: symbols_)
+                        PutString(head, s->ToString());
+                Put(os, head);
+                Put(os, words_);
+                Put(os, fills);
+                Put(os, cells_);
+        }
+private:
+        static void Put(std::ostream& os, const vector<uint64_t>& words)
+        {
+                os.write(reinterpret_cast<const char *>(words.data()),
+                         words.size() * sizeof(uint64_t));
+        }
+
+        static void PutString(vector<uint64_t>& words, const string& s)
+        {
+                size_t at = words.size();
+
+                words.push_back(s.size());
+                words.resize(at + 1 + (s.size() + 7) / 8, 0);
+                std::memcpy(&words[at + 1], s.data(), s.size());
+        }
+
+        uint64_t Symbol(const SymbolExpr *s)
+        {
+                auto search = symbol_ids_.find(s);
+
+                if (search != symbol_ids_.end())
+                        return (search->second);
+                uint64_t ref = symbols_.size() << 3 | kSymbolRef;
+                symbols_.push_back(s);
+                return (symbol_ids_[s] = ref);
+        }
+
+        // The objects e refers to are written before it.
+        uint64_t Ref(Value e)
+        {
+                if (e.IsSymbol())
+                        return (Symbol(e.AsSymbol()));
+                if (!e.IsObject())
+                        return (e.Bits());
+                return (objects_.at(e.AsObject()));
+        }
+
+        static void Children(Value e, vector<Value>& children)
+        {
+                children.clear();
+                switch (e.Type()) {
+                case ExprKind::Pair:
+                        children.push_back(e.AsPair()->First());
+                        children.push_back(e.AsPair()->Second());
+                        break;
+                case ExprKind::Function: {
+                        auto f = static_cast<const FunExpr *>(e.AsObject());
+                        children.push_back(f->body());
+                        children.push_back(f->code());
+                        break;
+                }
+                case ExprKind::Memo:
+                        children.push_back(static_cast<const MemoExpr *>(
+                                                   e.AsObject())->fn());
+                        break;
+                default:
+                        break;
+                }
+        }
+
+        // Writes the objects reachable from root that are not yet, each
+        // after its children.  Long lists are walked without recursing.
+        void Add(Value root)
+        {
+                // The objects to write, each with whether its children
+                // were pushed above it.
+                vector<std::pair<Value, bool>> stack;
+                vector<Value> children;
+
+                stack.push_back(std::make_pair(root, false));
+                while (!stack.empty()) {
+                        auto e = stack.back().first;
+                        if (!e.IsObject() || objects_.count(e.AsObject())) {
+                                stack.pop_back();
+                                continue;
+                        }
+                        if (!stack.back().second) {
+                                stack.back().second = true;
+                                Children(e, children);
+                                for (auto c: children)
+                                        stack.push_back(
+                                                std::make_pair(c, false));
+                                continue;
+                        }
+                        stack.pop_back();
+                        Emit(e);
+                        objects_[e.AsObject()] =
+                                objects_.size() << 3 | kObjectRef;
+                }
+        }
+
+        void Emit(Value e)
+        {
+                auto put = [this](ImageRecord r) {
+                        words_.push_back(static_cast<uint64_t>(r));
+                };
+
+                switch (e.Type()) {
+                case ExprKind::Pair:
+                        put(ImageRecord::Pair);
+                        words_.push_back(Ref(e.AsPair()->First()));
+                        words_.push_back(Ref(e.AsPair()->Second()));
+                        return;
+                case ExprKind::String:
+                        put(ImageRecord::String);
+                        PutString(words_, static_cast<const StrExpr *>(
+                                          e.AsObject())->Str());
+                        return;
+                case ExprKind::Num: {
+                        auto n = static_cast<const NumExpr *>(e.AsObject());
+                        if (n->IsExact()) {
+                                put(ImageRecord::Int);
+                                words_.push_back(n->Int());
+                        } else {
+                                double d = n->Real();
+                                uint64_t bits;
+                                std::memcpy(&bits, &d, sizeof(bits));
+                                put(ImageRecord::Real);
+                                words_.push_back(bits);
+                        }
+                        return;
+                }
+                case ExprKind::Function: {
+                        auto f = static_cast<const FunExpr *>(e.AsObject());
+                        put(ImageRecord::Function);
+                        words_.push_back(f->name() != NULL ?
+                                         Symbol(f->name()) : kNil.Bits());
+                        words_.push_back(f->params().size());
+                        for (auto p: f->params())
+                                words_.push_back(Symbol(p));
+                        words_.push_back(Ref(f->body()));
+                        words_.push_back(Ref(f->code()));
+                        return;
+                }
+                case ExprKind::Local: {
+                        auto l = static_cast<const LocalRefExpr *>(
+                                e.AsObject());
+                        put(ImageRecord::Local);
+                        words_.push_back(l->Slot());
+                        words_.push_back(Symbol(l->Name()));
+                        return;
+                }
+                case ExprKind::Primitive:
+                        if (static_cast<const PrimExpr *>(
+                                    e.AsObject())->native())
+                                break;
+                        put(ImageRecord::Primitive);
+                        PutString(words_, e.ToString());
+                        return;
+                case ExprKind::Memo: {
+                        auto m = static_cast<const MemoExpr *>(e.AsObject());
+                        put(ImageRecord::Memo);
+                        words_.push_back(Ref(m->fn()));
+                        words_.push_back(m->capacity());
+                        return;
+                }
+                case ExprKind::Vector: {
+                        auto v = static_cast<const VecExpr *>(e.AsObject());
+                        put(ImageRecord::Vector);
+                        words_.push_back(v->Size());
+                        for (size_t i = 0; i < v->Size(); i++) {
+                                uint64_t bits;
+                                std::memcpy(&bits, v->Data() + i,
+                                            sizeof(bits));
+                                words_.push_back(bits);
+                        }
+                        return;
+                }
+                case ExprKind::Hash:
+                        put(ImageRecord::Hash);
+                        words_.push_back(static_cast<const HashExpr *>(
+                                                 e.AsObject())->Count());
+                        tables_.push_back(e);
+                        return;
+                default:
+                        break;
+                }
+                throw LispException(e.ToString() + " can't be dumped.");
+        }
+
+        unordered_map<const SymbolExpr *, uint64_t> symbol_ids_;
+        vector<const SymbolExpr *> symbols_;
+        unordered_map<const LispExprInterface *, uint64_t> objects_;
+        // The records of the objects, in order.
+        vector<uint64_t> words_;
+        // The hash tables written, to fill.
+        vector<Value> tables_;
+        // The symbol and the value of each binding.
+        vector<uint64_t> cells_;
+};
+
+class ImageReader {
+public:
+        explicit ImageReader(ImageReader const&)        = delete;
+        void operator=(ImageReader const&)              = delete;
+
+        explicit ImageReader(const void *data, size_t size) :
+                words_(static_cast<const uint64_t *>(data)),
+                size_(size / sizeof(uint64_t)), pos_(0)
+        {}
+
+        // Defines the bindings of the image in env, an environment where
+        // the primitives are defined.
+        void Read(GlobalEnv& env)
+        {
+                unordered_map<string, Value> prims;
+                GcRoot objects_root(&objects_);
+
+                if (size_ == 0 || Next() != kImageMagic)
+                        throw LispException("Not a heap image.");
+                size_t symbols = Count();
+                size_t objects = Count();
+                size_t tables = Count();
+                size_t cells = Count();
+
+                for (size_t i = 0; i < symbols; i++)
+                        symbols_.push_back(SymbolExpr::GetInstance(
+                                                   NextString()));
+                env.ForEach([&prims](const SymbolExpr *, Value e) {
+                        if (e.Type() == ExprKind::Primitive)
+                                prims[e.ToString()] = e;
+                });
+                objects_.reserve(objects);
+                for (size_t i = 0; i < objects; i++)
+                        objects_.push_back(NextObject(prims));
+                for (size_t i = 0; i < tables; i++) {
+                        auto table = Ref(Next());
+                        if (table.Type() != ExprKind::Hash)
+                                throw LispException("Corrupt heap image.");
+                        auto h = static_cast<const HashExpr *>(
+                                table.AsObject());
+                        for (size_t n = Count(); n > 0; n--) {
+                                auto key = Ref(Next());
+                                h->Set(key, Ref(Next()));
+                        }
+                }
+                for (size_t i = 0; i < cells; i++) {
+                        auto s = Symbol(Next());
+                        env.define(s, Ref(Next()));
+                }
+                if (pos_ != size_)
+                        throw LispException("Corrupt heap image.");
+        }
+private:
+        uint64_t Next()
+        {
+                if (pos_ == size_)
+                        throw LispException("Truncated heap image.");
+                return (words_[pos_++]);
+        }
+
+        // A number of items, each taking a word at least.
+        size_t Count()
+        {
+                auto n = Next();
+
+                if (n > size_)
+                        throw LispException("Corrupt heap image.");
+                return (n);
+        }
+
+        string NextString()
+        {
+                size_t n = Next();
+                size_t words = (n + 7) / 8;
+
+                if (n > size_ * 8 || words > size_ - pos_)
+                        throw LispException("Truncated heap image.");
+                string s(reinterpret_cast<const char *>(words_ + pos_), n);
+                pos_ += words;
+                return (s);
+        }
+
+        const SymbolExpr *Symbol(uint64_t ref) const
+        {
+                if ((ref & Value::kTagMask) != kSymbolRef ||
+                    (ref >> 3) >= symbols_.size())
+                        throw LispException("Corrupt heap image.");
+                return (symbols_[ref >> 3]);
+        }
+
+        Value Ref(uint64_t ref) const
+        {
+                switch (ref & Value::kTagMask) {
+                case kSymbolRef:
+                        return (Value::Symbol(Symbol(ref)));
+                case kObjectRef:
+                        if ((ref >> 3) < objects_.size())
+                                return (objects_[ref >> 3]);
+                        break;
+                case Value::kFixnumTag:
+                        return (Value::FromBits(ref));
+                default:
+                        if (ref == kNil.Bits() || ref == kTrue.Bits())
+                                return (Value::FromBits(ref));
+                        break;
+                }
+                throw LispException("Corrupt heap image.");
+        }
+
+        Value NextObject(const unordered_map<string, Value>& prims)
+        {
+                switch (static_cast<ImageRecord>(Next())) {
+                case ImageRecord::Pair: {
+                        auto first = Ref(Next());
+                        return (Cons(first, Ref(Next())));
+                }
+                case ImageRecord::String:
+                        return (MakeString(NextString()));
+                case ImageRecord::Int:
+                        return (MakeInt(static_cast<int64_t>(Next())));
+                case ImageRecord::Real: {
+                        uint64_t bits = Next();
+                        double d;
+                        std::memcpy(&d, &bits, sizeof(d));
+                        return (MakeReal(d));
+                }
+                case ImageRecord::Function: {
+                        auto name = Next();
+                        vector<const SymbolExpr *> params(Count());
+                        for (auto& p: params)
+                                p = Symbol(Next());
+                        auto body = Ref(Next());
+                        auto code = Ref(Next());
+                        return (new FunExpr(params, body, code,
+                                            name == kNil.Bits() ? NULL :
+                                            Symbol(name)));
+                }
+                case ImageRecord::Local: {
+                        size_t slot = Next();
+                        return (new LocalRefExpr(slot, Symbol(Next())));
+                }
+                case ImageRecord::Primitive: {
+                        auto name = NextString();
+                        auto search = prims.find(name);
+                        if (search == prims.end())
+                                throw LispException("Unknown primitive " +
+                                                    name + '.');
+                        return (search->second);
+                }
+                case ImageRecord::Memo: {
+                        auto fn = Ref(Next());
+                        return (new MemoExpr(fn, Next()));
+                }
+                case ImageRecord::Vector: {
+                        auto v = VecExpr::Make(Count());
+                        for (size_t i = 0; i < v->Size(); i++) {
+                                uint64_t bits = Next();
+                                std::memcpy(v->Data() + i, &bits,
+                                            sizeof(bits));
+                        }
+                        return (v);
+                }
+                case ImageRecord::Hash:
+                        return (new HashExpr(Count()));
+                }
+                throw LispException("Corrupt heap image.");
+        }
+
+        const uint64_t *words_;
+        const size_t size_;
+        size_t pos_;
+        vector<const SymbolExpr *> symbols_;
+        vector<Value> objects_;
+};
+
+// Counts the calls of the functions and the primitives while profiling, and
+// the time spent and the objects allocated in them.  The calls running are
+// kept on a stack of their own, each on the node of the tree of the call
+// paths met so far, so that the time of a call is split between the node
+// and those it calls.  A call in tail position takes the place of its caller
+// there as it does on the stack of the engine.
+class Profiler {
+public:
+        explicit Profiler(Profiler const&)      = delete;
+        void operator=(Profiler const&)         = delete;
+
+        // Starts from the root, the top level.
+        explicit Profiler() : nodes_(1) {}
+
+        size_t Depth() const { return (stack_.size()); }
+
+        // Starts a call of fn, a function or a primitive.
+        void Enter(Value fn)
+        {
+                const void *key = fn.AsObject();
+
+                if (fn.Type() != ExprKind::Primitive) {
+                        auto name = static_cast<const FunExpr *>(
+                                fn.AsObject())->name();
+                        key = name != NULL ? name :
+                                static_cast<const void *>(&kLambda);
+                }
+                size_t node = Child(stack_.empty() ? 0 : stack_.back().node,
+                                    key, fn);
+                nodes_[node].calls++;
+                stack_.push_back(Entry(node,
+                                       Heap::GetInstance().Allocations()));
+        }
+
+        // Ends the call started last.
+        void Leave()
+        {
+                auto& top = stack_.back();
+                auto time = Clock::now() - top.start;
+                size_t allocations = Heap::GetInstance().Allocations() -
+                        top.allocations;
+                auto& node = nodes_[top.node];
+
+                node.total += time;
+                node.self += time - top.callees;
+                node.allocations += allocations;
+                node.self_allocations += allocations - top.callee_allocations;
+                stack_.pop_back();
+                if (!stack_.empty()) {
+                        stack_.back().callees += time;
+                        stack_.back().callee_allocations += allocations;
+                }
+        }
+
+        // Ends the calls started since the depth given, after an error.
+        void Unwind(size_t depth)
+        {
+
+                while (stack_.size() > depth)
+                        Leave();
+        }
+
+        // Ends the calls started in scope on the way out of it, whether it
+        // returns or throws.
+        class Scope {
+        public:
+                explicit Scope(Scope const&)            = delete;
+                void operator=(Scope const&)            = delete;
+
+                explicit Scope(Profiler *profiler) :
+                        profiler_(profiler),
+                        depth_(profiler != NULL ? profiler->Depth() : 0)
+                {}
+
+                ~Scope()
+                {
+
+                        if (profiler_ != NULL)
+                                profiler_->Unwind(depth_);
+                }
+
+                // Starts a call of fn in place of the one made in scope
+                // before, if any.
+                void Call(Value fn)
+                {
+
+                        if (profiler_ == NULL)
+                                return;
+                        profiler_->Unwind(depth_);
+                        profiler_->Enter(fn);
+                }
+        private:
+                Profiler *const profiler_;
+                const size_t depth_;
+        };
+
+        // Prints a line per function and primitive called, the slowest on
+        // their own first.  The time and the allocations of a recursive call
+        // count once in the total of the function.
+        void Report(std::ostream& os) const
+        {
+                struct Stats {
+                        Stats() : calls(0), total(0), self(0),
+                                  allocations(0), self_allocations(0) {}
+
+                        size_t calls;
+                        Clock::duration total, self;
+                        size_t allocations, self_allocations;
+                };
+                unordered_map<const void *, Stats> stats;
+                // The number of the calls of each key on the path walked.
+                unordered_map<const void *, size_t> open;
+
+                Walk([&stats, &open](const Node& node, bool enter) {
+                        auto& s = stats[node.key];
+                        auto& n = open[node.key];
+                        if (!enter) {
+                                n--;
+                                return;
+                        }
+                        s.calls += node.calls;
+                        s.self += node.self;
+                        s.self_allocations += node.self_allocations;
+                        if (n++ == 0) {
+                                s.total += node.total;
+                                s.allocations += node.allocations;
+                        }
+                });
+
+                vector<std::pair<const void *, Stats>> rows(stats.begin(),
+                                                            stats.end());
+                std::sort(rows.begin(), rows.end(),
+                          [](const std::pair<const void *, Stats>& a,
+                             const std::pair<const void *, Stats>& b) {
+                                  return (a.second.self > b.second.self);
+                          });
+                os << std::setw(10) << "calls" << std::setw(12) <<
+                        "total ms" << std::setw(12) << "self ms" <<
+                        std::setw(12) << "allocs" << std::setw(12) <<
+                        "self allocs" << "  name\n" << std::fixed <<
+                        std::setprecision(3);
+                for (auto& row: rows) {
+                        auto& s = row.second;
+                        os << std::setw(10) << s.calls << std::setw(12) <<
+                                Millis(s.total) << std::setw(12) <<
+                                Millis(s.self) << std::setw(12) <<
+                                s.allocations << std::setw(12) <<
+                                s.self_allocations << "  " <<
+                                names_.at(row.first) << '\n';
+                }
+                os << std::defaultfloat;
+        }
+
+        // Writes a line per call path, its names separated by semicolons
+        // and the nanoseconds spent in its last call on its own, the folded
+        // stacks that flame graph tools read.
+        void WriteFolded(std::ostream& os) const
+        {
+                string path;
+                vector<size_t> lengths;
+
+                Walk([this, &os, &path, &lengths](const Node& node,
+                                                  bool enter) {
+                        if (!enter) {
+                                path.resize(lengths.back());
+                                lengths.pop_back();
+                                return;
+                        }
+                        lengths.push_back(path.size());
+                        if (!path.empty())
+                                path += ';';
+                        path += names_.at(node.key);
+                        auto ns = std::chrono::duration_cast<
+                                std::chrono::nanoseconds>(node.self).count();
+                        if (ns > 0)
+                                os << path << ' ' << ns << '\n';
+                });
+        }
+private:
+        typedef std::chrono::steady_clock Clock;
+
+        struct Node {
+                Node() : key(NULL), calls(0), total(0), self(0),
+                         allocations(0), self_allocations(0) {}
+
+                const void *key;
+                size_t calls;
+                Clock::duration total, self;
+                size_t allocations, self_allocations;
+                // The nodes of the calls made from this one, and their keys.
+                vector<std::pair<const void *, size_t>> children;
+        };
+
+        struct Entry {
+                Entry(size_t node, size_t allocations) :
+                        node(node), start(Clock::now()),
+                        allocations(allocations), callees(0),
+                        callee_allocations(0) {}
+
+                size_t node;
+                Clock::time_point start;
+                size_t allocations;
+                // What the calls made from this one took so far.
+                Clock::duration callees;
+                size_t callee_allocations;
+        };
+
+        // Stands for the functions without a name.
+        static const char kLambda;
+
+        static double Millis(Clock::duration d)
+        {
+
+                return (std::chrono::duration<double, std::milli>(d).count());
+        }
+
+        // Returns the node of the calls of key from parent, fn being one.
+        size_t Child(size_t parent, const void *key, Value fn)
+        {
+
+                for (auto& child: nodes_[parent].children)
+                        if (child.first == key)
+                                return (child.second);
+                size_t node = nodes_.size();
+                nodes_[parent].children.push_back(std::make_pair(key, node));
+                nodes_.emplace_back();
+                nodes_.back().key = key;
+                if (!names_.count(key))
+                        names_[key] = key == &kLambda ? "LAMBDA" :
+                                fn.Type() == ExprKind::Primitive ?
+                                fn.ToString() :
+                                static_cast<const FunExpr *>(
+                                        fn.AsObject())->name()->ToString();
+                return (node);
+        }
+
+        // Calls visit on each node but the root, depth first, with true on
+        // the way down and false on the way back up.
+        template <typename Visit>
+        void Walk(Visit visit) const
+        {
+                // The nodes being visited, and the next child of each.
+                vector<std::pair<size_t, size_t>> path;
+
+                path.push_back(std::make_pair(0, 0));
+                while (!path.empty()) {
+                        auto& top = path.back();
+                        auto& children = nodes_[top.first].children;
+                        if (top.second == children.size()) {
+                                if (top.first != 0)
+                                        visit(nodes_[top.first], false);
+                                path.pop_back();
+                                continue;
+                        }
+                        size_t next = children[top.second++].second;
+                        visit(nodes_[next], true);
+                        path.push_back(std::make_pair(next, 0));
+                }
+        }
+
+        vector<Node> nodes_;
+        vector<Entry> stack_;
+        unordered_map<const void *, string> names_;
+};
+
+const char Profiler::kLambda = 0;
+
+// Where PROFILE and the !profile command write the folded stacks.
+const char kFoldedStacks[] = "profile.folded";
+
+class SimpleLispInterpreter {
+public:
+        explicit SimpleLispInterpreter(Engine engine) :
+                engine_(engine), global_root_(&global_env_), vm_root_(&vm_),
+                native_root_(&native_values_), caller_env_(NULL)
+        {
+                InitGlobalEnv();
+        }
+
+        // Starts from the global bindings of base, without defining the
+        // primitives again.
+        explicit SimpleLispInterpreter(const SimpleLispInterpreter& base) :
+                SimpleLispInterpreter(base.engine_, base.global_env_)
+        {}
+
+        // Defines the functions of a library built from the output of
+        // Translate().
+        void Load(const string& path)
+        {
+                static const YispApi api = {
+                        NativeCall, NativeRead, NativeGlobal, NativeDefine,
+                        NativeError
+                };
+                auto lib = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+                if (lib == NULL)
+                        throw LispException(dlerror());
+                auto init = reinterpret_cast<void (*)(const YispApi *)>(
+                        dlsym(lib, "yisp_init"));
+                if (init == NULL)
+                        throw LispException(
+                                path + ": not a compiled Yisp library.");
+
+                loading_ = this;
+                try {
+                        init(&api);
+                } catch (...) {
+                        loading_ = NULL;
+                        throw;
+                }
+                loading_ = NULL;
+        }
+
+        // Translates the file of DEFINEs at path to C++ that defines the same
+        // functions once built as a library and loaded.  The functions become
+        // primitives: they call each other and the primitives bound at the
+        // time of the translation directly, and do not bind their parameters
+        // in the dynamic environment.  That is why only the functions that
+        // use no free variable, and call nothing but those and primitives,
+        // can be translated.
+        void Translate(const string& path, std::ostream& os)
+        {
+                std::ifstream is(path);
+                if (!is)
+                        throw LispException("Cannot read " + path + '.');
+
+                Reader reader(is);
+                vector<Value> exprs;
+                GcRoot exprs_root(&exprs);
+                Value e;
+                while (reader.Read(e))
+                        exprs.push_back(e);
+
+                Translation t;
+                vector<Value> bodies;
+                for (auto e: exprs) {
+                        size_t n;
+                        if (e.Type() != ExprKind::Pair ||
+                            !IsList(e.AsPair(), n) || n != 4 ||
+                            !e.AsPair()->First().IsSymbol() ||
+                            e.AsPair()->First().AsSymbol()->Special() !=
+                            SpecialForm::Define)
+                                throw LispException(
+                                        "Not a function definition: " +
+                                        e.ToString());
+                        auto p = e.AsPair();
+                        auto name = SymbolCast(Nth(p, 1));
+                        if (t.funs.count(name))
+                                throw LispException(
+                                        name->ToString() +
+                                        " is defined twice.");
+                        t.funs[name] = t.names.size();
+                        t.names.push_back(name);
+                        t.params.push_back(FunParams(Nth(p, 2)));
+                        bodies.push_back(Nth(p, 3));
+                }
+
+                std::ostringstream defs;
+                for (t.fun = 0; t.fun < bodies.size(); t.fun++) {
+                        t.body.str("");
+                        t.temps = 0;
+                        t.depth = 1;
+                        t.loops = false;
+                        TranslateTail(t, bodies[t.fun]);
+
+                        defs << "\n// " << t.names[t.fun]->ToString() <<
+                                "\nuint64_t\nf" << t.fun << '(';
+                        auto& params = t.params[t.fun];
+                        for (size_t i = 0; i < params.size(); i++)
+                                defs << (i ? ", " : "") << "uint64_t a" << i;
+                        defs << ")\n{\n" << (t.loops ? "top:\n" : "") <<
+                                t.body.str() << "}\n";
+                }
+
+                os << "// Compiled from " << path << ", do not edit.  " <<
+                        "Build it with\n" <<
+                        "//   g++ -std=c++11 -O2 -shared -fPIC " <<
+                        "-o lib.so lib.cpp\n" <<
+                        "// and load the library with -l lib.so.\n" <<
+                        "#include <cstddef>\n#include <cstdint>\n" <<
+                        "#include <string>\n\nnamespace {\n\n" <<
+                        kApiSource << ";\n\nconst YispApi *api;\n\n" <<
+                        "const uint64_t kNil = " << kNil.Bits() << ";\n" <<
+                        "const uint64_t kTrue = " << kTrue.Bits() << ";\n" <<
+                        "const uint64_t kTagMask = " << Value::kTagMask <<
+                        ";\n" <<
+                        "const uint64_t kFixnumTag = " << Value::kFixnumTag <<
+                        ";\n" <<
+                        "const int64_t kMinFixnum = " << Value::kMinFixnum <<
+                        "LL;\n" <<
+                        "const int64_t kMaxFixnum = " << Value::kMaxFixnum <<
+                        "LL;\n\n";
+                if (!t.consts.empty())
+                        os << "// Constants.\nuint64_t k[" <<
+                                t.consts.size() << "];\n";
+                if (!t.prims.empty())
+                        os << "// Primitives.\nuint64_t p[" <<
+                                t.prim_names.size() << "];\n";
+                os << kNativeRuntime;
+                for (size_t i = 0; i < t.names.size(); i++) {
+                        os << "uint64_t f" << i << '(';
+                        for (size_t j = 0; j < t.params[i].size(); j++)
+                                os << (j ? ", " : "") << "uint64_t";
+                        os << ");\n";
+                }
+                os << defs.str();
+
+                for (size_t i = 0; i < t.names.size(); i++) {
+                        auto arity = t.params[i].size();
+                        os << "\nuint64_t\ne" << i <<
+                                "(const uint64_t *args, size_t n)\n{\n" <<
+                                "        if (n != " << arity << ")\n" <<
+                                "                api->error((\"" <<
+                                t.names[i]->ToString() << ": given \" + " <<
+                                "std::to_string(n) +\n" <<
+                                "                    \" arguments " <<
+                                "instead of " << arity << ".\").c_str());\n" <<
+                                "        return (f" << i << '(';
+                        for (size_t j = 0; j < arity; j++)
+                                os << (j ? ", " : "") << "args[" << j << ']';
+                        os << "));\n}\n";
+                }
+
+                os << "\n} // namespace\n\nextern \"C\" void\n" <<
+                        "yisp_init(const YispApi *a)\n{\n" <<
+                        "        api = a;\n";
+                for (size_t i = 0; i < t.consts.size(); i++)
+                        os << "        k[" << i << "] = api->read(\"" <<
+                                Escape(t.consts[i]) << "\");\n";
+                for (size_t i = 0; i < t.prim_names.size(); i++)
+                        os << "        p[" << i << "] = api->global(\"" <<
+                                Escape(t.prim_names[i]) << "\");\n";
+                for (size_t i = 0; i < t.names.size(); i++)
+                        os << "        api->define(\"" <<
+                                Escape(t.names[i]->ToString()) << "\", e" <<
+                                i << ");\n";
+                os << "}\n";
+        }
+
+        void Process(const string &inputStr, std::ostream& os = std::cout)
+        {
+                std::istringstream is(inputStr);
+                Reader reader(is);
+
+                while (Process(reader, os))
+                        ;
+        }
+
+        // Reads the next form and prints its value on os.  Returns false at
+        // the end of the input.
+        bool Process(Reader& reader, std::ostream& os = std::cout)
+        {
+
+                return (Step(reader, &os));
+        }
+
+        // Evaluates the forms of the file at path, a prelude, without
+        // printing their values.
+        void Source(const string& path)
+        {
+                std::ifstream is(path);
+
+                if (!is)
+                        throw LispException(path + ": " +
+                                            std::strerror(errno));
+                Reader reader(is);
+                while (Step(reader, NULL))
+                        ;
+        }
+
+        // Writes the global bindings, and the data they reach, to an image
+        // that Restore() starts from.
+        void Dump(const string& path) const
+        {
+                ImageWriter image;
+                std::ofstream os(path, std::ios::binary);
+
+                global_env_.ForEach([&image](const SymbolExpr *s, Value e) {
+                        image.Bind(s, e);
+                });
+                image.Write(os);
+                if (!os.flush())
+                        throw LispException(path + ": " +
+                                            std::strerror(errno));
+        }
+
+        // Defines the bindings of the image at path.  The file is mapped
+        // and the objects built straight from its words, nothing is parsed.
+        void Restore(const string& path)
+        {
+                struct stat st;
+                int fd = open(path.c_str(), O_RDONLY);
+
+                if (fd < 0 || fstat(fd, &st) != 0) {
+                        string error = std::strerror(errno);
+                        if (fd >= 0)
+                                close(fd);
+                        throw LispException(path + ": " + error);
+                }
+                void *p = st.st_size == 0 ? MAP_FAILED :
+                        mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                close(fd);
+                if (p == MAP_FAILED)
+                        throw LispException(path + ": Not a heap image.");
+
+                try {
+                        ImageReader(p, st.st_size).Read(global_env_);
+                } catch (const std::exception& e) {
+                        munmap(p, st.st_size);
+                        throw LispException(path + ": " + e.what());
+                }
+                munmap(p, st.st_size);
+                Heap::GetInstance().Escape();
+        }
+
+        bool Profiling() const { return (profiler_ != NULL); }
+
+        // Counts the calls made from now on, until StopProfiling().
+        void StartProfiling()
+        {
+
+                profiler_.reset(new Profiler());
+        }
+
+        // Prints the calls counted on os, and writes their stacks folded to
+        // the file at path.
+        void StopProfiling(std::ostream& os, const string& path)
+        {
+                std::unique_ptr<Profiler> profiler(std::move(profiler_));
+                std::ofstream folded(path);
+
+                profiler->Report(os);
+                profiler->WriteFolded(folded);
+                if (!folded.flush())
+                        throw LispException(path + ": " +
+                                            std::strerror(errno));
+        }
+
+        // Prints a line per counter of Stats(), those of the objects of
+        // each kind under a header.
+        void ReportStats(std::ostream& os) const
+        {
+                bool kinds = false;
+
+                for (auto& stat: Stats()) {
+                        if (!kinds && stat.second.size() == 2) {
+                                os << std::setw(28) << "allocated" <<
+                                        std::setw(12) << "live" << '\n';
+                                kinds = true;
+                        }
+                        os << std::left << std::setw(16) << stat.first <<
+                                std::right;
+                        for (auto n: stat.second)
+                                os << std::setw(12) << n;
+                        os << '\n';
+                }
+                os << std::flush;
+        }
+
+private:
+        // Reads the next form and prints its value on os, unless NULL.
+        // Returns false at the end of the input.
+        bool Step(Reader& reader, std::ostream *os)
+        {
+                // Unless a SET or a DEFINE stores them in the global
+                // environment, the objects allocated while processing the
+                // form are garbage once it is done.
+                HeapRegion region;
+                Running running(this);
+                Value in;
+                GcRoot in_root(&in);
+
+                if (!reader.Read(in))
+                        return (false);
+
+                Heap::GetInstance().MaybeCollect();
+                Value out;
+                if (engine_ == Engine::Bytecode) {
+                        Chunk chunk;
+                        EmitCode(chunk, in, true);
+                        out = Execute(&chunk, NULL);
+                } else
+                        out = Evaluate(in, NULL);
+                if (os != NULL)
+                        *os << out.ToString() << '\n';
+                return (true);
+        }
+
+        const Engine engine_;
+        GlobalEnv global_env_;
+        GcRoot global_root_;
+        Vm vm_;
+        GcRoot vm_root_;
+        // The constants and the primitives the loaded libraries refer to.
+        vector<Value> native_values_;
+        GcRoot native_root_;
+        // The interpreter loading a library, that its calls back refer to.
+        static thread_local SimpleLispInterpreter *loading_;
+        // The bindings the primitive being called sees, for those calling
+        // procedures back.
+        const Env *caller_env_;
+        // Set while profiling.
+        std::unique_ptr<Profiler> profiler_;
+
+        // What the interpreter did so far, see STATS.
+        struct Counters {
+                Counters() : frames(0), evaluations(0), instructions(0),
+                             depth(0), max_depth(0) {}
+
+                void Reach(size_t d)
+                {
+
+                        if (d > max_depth)
+                                max_depth = d;
+                }
+
+                // The frames binding the arguments of a call, a tail call
+                // rebinding the frame of its caller counting as one.
+                size_t frames;
+                size_t evaluations;
+                size_t instructions;
+                // The invocations of Evaluate() running.
+                size_t depth;
+                // The deepest the calls nested, counting both the
+                // invocations of Evaluate() and the frames of the bytecode
+                // machine.
+                size_t max_depth;
+        };
+
+        Counters counters_;
+        // The interpreter evaluating on the thread.
+        static thread_local SimpleLispInterpreter *running_;
+
+        // Makes an interpreter the one evaluating on the thread while in
+        // scope.
+        class Running {
+        public:
+                explicit Running(Running const&)        = delete;
+                void operator=(Running const&)          = delete;
+
+                explicit Running(SimpleLispInterpreter *interp) :
+                        saved_(running_)
+                {
+                        running_ = interp;
+                }
+
+                ~Running() { running_ = saved_; }
+        private:
+                SimpleLispInterpreter *saved_;
+        };
+
+        // The counters of the interpreter and of the heap of the thread,
+        // each under its name, then the objects allocated and those live
+        // for each kind allocated.
+        vector<std::pair<string, vector<size_t>>> Stats() const
+        {
+                auto& heap = Heap::GetInstance();
+                vector<size_t> allocated, live;
+                size_t bytes;
+
+                heap.Census(allocated, live, bytes);
+                size_t objects = 0;
+                for (auto n: live)
+                        objects += n;
+                vector<std::pair<string, vector<size_t>>> stats = {
+                        {"ALLOCATIONS", {heap.Allocations()}},
+                        {"BYTES", {heap.Bytes()}},
+                        {"LIVE-OBJECTS", {objects}},
+                        {"LIVE-BYTES", {bytes}},
+                        {"FRAMES", {counters_.frames}},
+                        {"SYMBOLS", {SymbolExpr::Count()}},
+                        {"EVALUATIONS", {counters_.evaluations}},
+                        {"INSTRUCTIONS", {counters_.instructions}},
+                        {"MAX-DEPTH", {counters_.max_depth}},
+                };
+                for (size_t i = 0; i < kNumKinds; i++)
+                        if (allocated[i] != 0)
+                                stats.push_back({kKindNames[i],
+                                                 {allocated[i], live[i]}});
+                return (stats);
+        }
+
+        // Counts an invocation of Evaluate() while in scope.
+        class Nesting {
+        public:
+                explicit Nesting(Nesting const&)        = delete;
+                void operator=(Nesting const&)          = delete;
+
+                explicit Nesting(SimpleLispInterpreter& interp) :
+                        counters_(interp.counters_)
+                {
+                        counters_.evaluations++;
+                        counters_.depth++;
+                        counters_.Reach(counters_.depth + interp.vm_.Depth());
+                }
+
+                ~Nesting() { counters_.depth--; }
+        private:
+                Counters& counters_;
+        };
+
+        // What a task starts from: a copy of the global bindings, and of
+        // the bindings of the frames of the caller flattened in one.
+        struct Snapshot {
+                explicit Snapshot(const GlobalEnv& g) : globals(g) {}
+
+                GlobalEnv globals;
+                vector<const SymbolExpr *> names;
+                vector<Value> slots;
+        };
+
+        // Where the tasks of a parallel call count down, and leave the
+        // first error raised.
+        struct Join {
+                explicit Join(size_t n) : remaining(n), failed(false) {}
+
+                void Fail(const string& what)
+                {
+                        std::lock_guard<std::mutex> guard(lock);
+
+                        if (!failed) {
+                                error = what;
+                                failed = true;
+                        }
+                }
+
+                std::atomic<size_t> remaining;
+                std::atomic<bool> failed;
+                std::mutex lock;
+                string error;
+        };
+
+        typedef std::function<void(SimpleLispInterpreter&, const Env *)> Body;
+        typedef std::function<void(SimpleLispInterpreter&, const Env *,
+                                   size_t, size_t, size_t)> RangeBody;
+
+        // The interpreter a task runs in.
+        SimpleLispInterpreter(Engine engine, const GlobalEnv& globals) :
+                engine_(engine), global_env_(globals),
+                global_root_(&global_env_), vm_root_(&vm_),
+                native_root_(&native_values_), caller_env_(NULL)
+        {}
+
+        // Queues body to run in an interpreter of its own, with the global
+        // bindings of this one and the bindings of env as they are now.
+        // What it SETs or DEFINEs stays in its interpreter.
+        void Spawn(const Env *env, const Body& body)
+        {
+                std::shared_ptr<Snapshot> snap(new Snapshot(global_env_));
+                auto engine = engine_;
+
+                for (; env != NULL; env = env->Next())
+                        for (size_t i = 0; i < env->Size(); i++) {
+                                snap->names.push_back(env->Name(i));
+                                snap->slots.push_back(env->Slot(i));
+                        }
+
+                ThreadPool::GetInstance().Submit([snap, engine, body]() {
+                        SimpleLispInterpreter interp(engine, snap->globals);
+                        Running running(&interp);
+                        Env env(snap->names, snap->slots, NULL);
+                        body(interp, snap->names.empty() ? NULL : &env);
+                });
+        }
+
+        // Runs body(interp, env, k, begin, end) over the ranges [begin, end)
+        // that split [0, n), the kth range in a task of its own, and waits
+        // for them.  Returns the number of ranges.
+        size_t ParallelFor(size_t n, const RangeBody& body)
+        {
+                if (n == 0)
+                        return (0);
+
+                auto& pool = ThreadPool::GetInstance();
+                // A few ranges per thread, so that the threads done first
+                // take over the work of the others.
+                size_t ranges = std::min(n, pool.Threads() * 4);
+                size_t grain = (n + ranges - 1) / ranges;
+
+                ranges = (n + grain - 1) / grain;
+                auto join = std::make_shared<Join>(ranges);
+                for (size_t k = 0; k < ranges; k++) {
+                        size_t begin = k * grain;
+                        size_t end = std::min(n, begin + grain);
+                        Spawn(caller_env_, [join, body, k, begin, end](
+                                      SimpleLispInterpreter& interp,
+                                      const Env *env) {
+                                try {
+                                        if (!join->failed)
+                                                body(interp, env, k, begin,
+                                                     end);
+                                } catch (const std::exception& e) {
+                                        join->Fail(e.what());
+                                }
+                                join->remaining--;
+                        });
+                }
+
+                pool.Wait([join]() { return (join->remaining.load() == 0); });
+                if (join->failed)
+                        throw LispException(join->error);
+                return (ranges);
+        }
+
+        static std::shared_ptr<vector<Value>> Elements(Value l)
+        {
+                std::shared_ptr<vector<Value>> elems(new vector<Value>());
+
+                for (; !l.IsNil(); l = PairCast(l)->Second())
+                        elems->push_back(PairCast(l)->First());
+                return (elems);
+        }
+
+        // (pmapcar fn list) is (mapcar fn list), with the calls of fn run in
+        // parallel.
+        static Value PrimPmapcar(vector<Value>& args)
+        {
+                AssertArgsNum("PMAPCAR", args, 2);
+
+                auto fn = args[0];
+                auto elems = Elements(args[1]);
+                auto results = std::make_shared<vector<Value>>(elems->size());
+                running_->ParallelFor(elems->size(), [fn, elems, results](
+                                              SimpleLispInterpreter& interp,
+                                              const Env *env, size_t,
+                                              size_t begin, size_t end) {
+                        vector<Value> args;
+                        for (size_t i = begin; i < end; i++) {
+                                args.assign(1, (*elems)[i]);
+                                (*results)[i] = interp.Apply(fn, args, env);
+                        }
+                });
+
+                // Nothing collects until the list is returned.
+                Value l = kNil;
+                for (size_t i = results->size(); i-- > 0; )
+                        l = Cons((*results)[i], l);
+                return (l);
+        }
+
+        // (preduce fn list [initial]) folds list with fn, an associative
+        // function: the ranges of the list are folded in parallel, and then
+        // their values in order.
+        static Value PrimPreduce(vector<Value>& args)
+        {
+                if (args.size() != 2 && args.size() != 3)
+                        throw LispException(
+                                "PREDUCE: Wrong number of arguments.");
+
+                auto fn = args[0];
+                auto elems = Elements(args[1]);
+                if (elems->empty()) {
+                        if (args.size() == 3)
+                                return (args[2]);
+                        throw LispException("PREDUCE: Empty list.");
+                }
+
+                auto env = running_->caller_env_;
+                auto folds = std::make_shared<vector<Value>>(elems->size());
+                size_t n = running_->ParallelFor(elems->size(),
+                                                 [fn, elems, folds](
+                                                         SimpleLispInterpreter&
+                                                         interp,
+                                                         const Env *env,
+                                                         size_t k,
+                                                         size_t begin,
+                                                         size_t end) {
+                        vector<Value> args;
+                        auto acc = (*elems)[begin];
+                        for (size_t i = begin + 1; i < end; i++) {
+                                args.assign({acc, (*elems)[i]});
+                                acc = interp.Apply(fn, args, env);
+                        }
+                        (*folds)[k] = acc;
+                });
+
+                vector<Value> values(folds->begin(), folds->begin() + n);
+                if (args.size() == 3)
+                        values.insert(values.begin(), args[2]);
+                Value acc = values[0];
+                vector<Value> pair;
+                GcRoot values_root(&values), acc_root(&acc),
+                        pair_root(&pair);
+                for (size_t k = 1; k < values.size(); k++) {
+                        pair.assign({acc, values[k]});
+                        acc = running_->Apply(fn, pair, env);
+                }
+                return (acc);
+        }
+
+        // (future fn arg...) calls fn on the arguments in a task, and
+        // returns a future that TOUCH waits for.
+        static Value PrimFuture(vector<Value>& args)
+        {
+                if (args.empty())
+                        throw LispException(
+                                "FUTURE: Wrong number of arguments.");
+
+                auto result = std::make_shared<FutureExpr::Result>();
+                auto fn = args[0];
+                vector<Value> rest(args.begin() + 1, args.end());
+                running_->Spawn(running_->caller_env_, [result, fn, rest](
+                                        SimpleLispInterpreter& interp,
+                                        const Env *env) {
+                        auto args = rest;
+                        try {
+                                result->value = interp.Apply(fn, args, env);
+                        } catch (const std::exception& e) {
+                                result->error = e.what();
+                                result->failed = true;
+                        }
+                        result->done = true;
+                });
+                return (new FutureExpr(result));
+        }
+
+        // (hash-for-each fn table) calls fn on the key and the value of each
+        // entry of table, in no particular order.  The entries are those
+        // of table when called, fn may change it.  Called from compiled
+        // code, it collects nothing until it returns (see NativeCall).
+        static Value PrimHashForEach(vector<Value>& args)
+        {
+                AssertArgsNum("HASH-FOR-EACH", args, 2);
+
+                auto entries = HashCast("HASH-FOR-EACH", args[1])->Entries();
+                auto fn = args[0];
+                vector<Value> pair;
+                GcRoot entries_root(&entries), fn_root(&fn),
+                        pair_root(&pair);
+                for (size_t i = 0; i < entries.size(); i += 2) {
+                        pair.assign({entries[i], entries[i + 1]});
+                        running_->Apply(fn, pair, running_->caller_env_);
+                }
+                return (kNil);
+        }
+
+        // (stats) returns the counters of the interpreter, each as a list of
+        // its name and its values, see Stats().
+        static Value PrimStats(vector<Value>& args)
+        {
+                AssertArgsNum("STATS", args, 0);
+
+                auto stats = running_->Stats();
+                Value l = kNil;
+                for (size_t i = stats.size(); i-- > 0; ) {
+                        auto& values = stats[i].second;
+                        Value stat = kNil;
+                        for (size_t j = values.size(); j-- > 0; )
+                                stat = Cons(MakeInt(values[j]), stat);
+                        auto name = Value::Symbol(
+                                SymbolExpr::GetInstance(stats[i].first));
+                        l = Cons(Cons(name, stat), l);
+                }
+                return (l);
+        }
+
+        // (room) prints the counters of STATS on std::cerr.
+        static Value PrimRoom(vector<Value>& args)
+        {
+                AssertArgsNum("ROOM", args, 0);
+
+                running_->ReportStats(std::cerr);
+                return (kNil);
+        }
+
+        // The state of a translation to C++.
+        struct Translation {
+                // The functions defined, numbered in order.
+                unordered_map<const SymbolExpr *, size_t> funs;
+                vector<const SymbolExpr *> names;
+                vector<vector<const SymbolExpr *>> params;
+                // The primitives called and the constants used.
+                unordered_map<const SymbolExpr *, size_t> prims;
+                vector<string> prim_names;
+                vector<string> consts;
+                // The function being translated and its code so far.
+                size_t fun;
+                std::ostringstream body;
+                size_t temps;
+                size_t depth;
+                // Whether it calls itself in tail position.
+                bool loops;
+        };
+
+        // Primitives called from compiled code.  The values compiled code
+        // holds are not rooted, and some primitives, PREDUCE or
+        // HASH-FOR-EACH, call procedures back that get to safepoints: the
+        // heap doesn't collect until they return.
+        static uint64_t NativeCall(uint64_t fn, const uint64_t *args, size_t n)
+        {
+                Heap::Hold hold(Heap::GetInstance());
+                vector<Value> argv;
+
+                for (size_t i = 0; i < n; i++)
+                        argv.push_back(Value::FromBits(args[i]));
+                return (static_cast<const PrimExpr *>(
+                                Value::FromBits(fn).AsObject())->
+                        Call(argv).Bits());
+        }
+
+        static uint64_t NativeRead(const char *text)
+        {
+                std::istringstream is(text);
+                Reader reader(is);
+                Value e, rest;
+
+                if (!reader.Read(e) || reader.Read(rest))
+                        throw LispException(string("Bad constant: ") + text);
+                loading_->native_values_.push_back(e);
+                return (e.Bits());
+        }
+
+        static uint64_t NativeGlobal(const char *name)
+        {
+                auto e = loading_->global_env_.lookup(
+                        SymbolExpr::GetInstance(name));
+
+                if (e == NULL || e->Type() != ExprKind::Primitive)
+                        throw LispException(
+                                string("Not a primitive: ") + name);
+                loading_->native_values_.push_back(*e);
+                return (e->Bits());
+        }
+
+        static void NativeDefine(const char *name, NativeFun *fn)
+        {
+
+                loading_->DefGlobal(
+                        SymbolExpr::GetInstance(name),
+                        new PrimExpr(fn, "<native:" + string(name) + '>'));
+        }
+
+        static void NativeError(const char *what)
+        {
+
+                throw LispException(what);
+        }
+
+        static string Escape(const string& s)
+        {
+                string out;
+
+                for (auto c: s) {
+                        if (c == '"' || c == '\\')
+                                out += '\\';
+                        if (c == '\n')
+                                out += "\\n";
+                        else
+                                out += c;
+                }
+
+                return (out);
+        }
+
+        // Returns the text the reader turns back into e.
+        string Literal(Value e)
+        {
+
+                // The fixnums are immediates, and print exactly.
+                if (e.Type() == ExprKind::Num && e.IsObject()) {
+                        auto n = static_cast<const NumExpr *>(e.AsObject());
+                        if (!n->IsExact()) {
+                                std::ostringstream ss;
+                                ss << std::setprecision(17) << n->Real();
+                                return (ss.str());
+                        }
+                }
+                if (e.Type() != ExprKind::Pair)
+                        return (e.ToString());
+
+                string s = "(";
+                for (; !e.IsNil(); e = PairCast(e)->Second()) {
+                        if (s.size() > 1)
+                                s += ' ';
+                        s += Literal(PairCast(e)->First());
+                }
+
+                return (s + ')');
+        }
+
+        void Emit(Translation& t, const string& line)
+        {
+
+                t.body << string(8 * t.depth, ' ') << line << '\n';
+        }
+
+        string Temp(Translation& t)
+        {
+
+                return ("r" + std::to_string(t.temps++));
+        }
+
+        string Constant(Translation& t, Value e)
+        {
+
+                if (e.IsFixnum() || e.IsNil() || e == kTrue)
+                        return ("UINT64_C(" + std::to_string(e.Bits()) + ')');
+                t.consts.push_back(Literal(e));
+                return ("k[" + std::to_string(t.consts.size() - 1) + ']');
+        }
+
+        LispException Untranslatable(Translation& t, const string& what)
+        {
+
+                return (LispException(t.names[t.fun]->ToString() + ": " +
+                                      what + " cannot be compiled."));
+        }
+
+        // Emits the code of the call p, a list of n elements, and returns
+        // the variable holding its value.
+        string TranslateCall(Translation& t, const PairExpr *p, size_t n)
+        {
+                auto first = p->First();
+                vector<string> args;
+
+                if (!first.IsSymbol())
+                        throw Untranslatable(t, "calling " + first.ToString());
+                for (Value e = p->Second();
+                     !e.IsNil();
+                     e = e.AsPair()->Second())
+                        args.push_back(TranslateExpr(t, e.AsPair()->First()));
+
+                auto name = first.AsSymbol();
+                auto r = Temp(t);
+                string call;
+                auto fun = t.funs.find(name);
+                if (fun != t.funs.end()) {
+                        auto arity = t.params[fun->second].size();
+                        if (arity != n - 1) {
+                                std::ostringstream ss;
+                                ss << name->ToString() << ": given " <<
+                                        n - 1 << " arguments instead of " <<
+                                        arity << '.';
+                                throw LispException(ss.str());
+                        }
+                        call = 'f' + std::to_string(fun->second) + '(';
+                        for (size_t i = 0; i < args.size(); i++)
+                                call += (i ? ", " : "") + args[i];
+                        Emit(t, "uint64_t " + r + " = " + call + ");");
+                        return (r);
+                }
+
+                auto e = global_env_.lookup(name);
+                if (e == NULL || e->Type() != ExprKind::Primitive)
+                        throw Untranslatable(t, "calling " + name->ToString());
+                auto prim = t.prims.find(name);
+                if (prim == t.prims.end()) {
+                        prim = t.prims.emplace(name, t.prim_names.size()).first;
+                        t.prim_names.push_back(name->ToString());
+                }
+                auto fn = "p[" + std::to_string(prim->second) + ']';
+
+                // The arithmetic on two fixnums is done inline.
+                static const char *const inline_prims[][2] = {
+                        {"+", "Add"}, {"-", "Sub"}, {"<", "Less"},
+                        {">", "Greater"}, {"=", "NumEq"}
+                };
+                if (args.size() == 2)
+                        for (auto& op: inline_prims)
+                                if (name->ToString() == op[0]) {
+                                        Emit(t, "uint64_t " + r + " = " +
+                                             op[1] + '(' + fn + ", " +
+                                             args[0] + ", " + args[1] +
+                                             ");");
+                                        return (r);
+                                }
+
+                if (args.empty()) {
+                        Emit(t, "uint64_t " + r + " = api->call(" + fn +
+                             ", NULL, 0);");
+                        return (r);
+                }
+                auto v = Temp(t);
+                call = "uint64_t " + v + "[] = {";
+                for (size_t i = 0; i < args.size(); i++)
+                        call += (i ? ", " : "") + args[i];
+                Emit(t, call + "};");
+                Emit(t, "uint64_t " + r + " = api->call(" + fn + ", " + v +
+                     ", " + std::to_string(args.size()) + ");");
+                return (r);
+        }
+
+        // Emits the code of e and returns the C++ expression of its value.
+        string TranslateExpr(Translation& t, Value e)
+        {
+                size_t n;
+
+                if (e.IsSymbol()) {
+                        auto& params = t.params[t.fun];
+                        for (size_t i = 0; i < params.size(); i++)
+                                if (params[i] == e.AsSymbol())
+                                        return ('a' + std::to_string(i));
+                        throw Untranslatable(t, "the free variable " +
+                                             e.ToString());
+                }
+                if (e.Type() != ExprKind::Pair)
+                        return (Constant(t, e));
+
+                auto p = e.AsPair();
+                if (!IsList(p, n))
+                        throw LispException(p->ToString());
+                auto first = p->First();
+                auto form = first.IsSymbol() ? first.AsSymbol()->Special() :
+                        SpecialForm::None;
+
+                switch (form) {
+                case SpecialForm::Quote:
+                        AssertList(p, 2);
+                        return (Constant(t, Nth(p, 1)));
+                case SpecialForm::If: {
+                        AssertList(p, 4);
+                        auto r = Temp(t);
+                        Emit(t, "uint64_t " + r + ";");
+                        auto test = TranslateExpr(t, Nth(p, 1));
+                        Emit(t, "if (" + test + " != kNil) {");
+                        t.depth++;
+                        auto x = TranslateExpr(t, Nth(p, 2));
+                        Emit(t, r + " = " + x + ";");
+                        t.depth--;
+                        Emit(t, "} else {");
+                        t.depth++;
+                        x = TranslateExpr(t, Nth(p, 3));
+                        Emit(t, r + " = " + x + ";");
+                        t.depth--;
+                        Emit(t, "}");
+                        return (r);
+                }
+                case SpecialForm::Cond: {
+                        if (n == 1 || n % 2 != 1)
+                                throw LispException(p->ToString());
+                        auto r = Temp(t);
+                        size_t depth = t.depth;
+                        Emit(t, "uint64_t " + r + " = kNil;");
+                        while (!p->Second().IsNil()) {
+                                p = p->Second().AsPair();
+                                auto test = TranslateExpr(t, p->First());
+                                Emit(t, "if (" + test + " != kNil) {");
+                                t.depth++;
+                                auto x = TranslateExpr(t, Nth(p, 1));
+                                Emit(t, r + " = " + x + ";");
+                                t.depth--;
+                                Emit(t, "} else {");
+                                t.depth++;
+                                p = p->Second().AsPair();
+                        }
+                        while (t.depth > depth) {
+                                t.depth--;
+                                Emit(t, "}");
+                        }
+                        return (r);
+                }
+                case SpecialForm::None:
+                        return (TranslateCall(t, p, n));
+                default:
+                        throw Untranslatable(t, first.ToString());
+                }
+        }
+
+        // Emits the code returning the value of e.
+        void TranslateTail(Translation& t, Value e)
+        {
+                size_t n;
+
+                if (e.Type() != ExprKind::Pair || !IsList(e.AsPair(), n)) {
+                        Emit(t, "return (" + TranslateExpr(t, e) + ");");
+                        return;
+                }
+
+                auto p = e.AsPair();
+                auto first = p->First();
+                auto form = first.IsSymbol() ? first.AsSymbol()->Special() :
+                        SpecialForm::None;
+
+                if (form == SpecialForm::If) {
+                        AssertList(p, 4);
+                        auto test = TranslateExpr(t, Nth(p, 1));
+                        Emit(t, "if (" + test + " != kNil) {");
+                        t.depth++;
+                        TranslateTail(t, Nth(p, 2));
+                        t.depth--;
+                        Emit(t, "}");
+                        TranslateTail(t, Nth(p, 3));
+                } else if (form == SpecialForm::Cond) {
+                        if (n == 1 || n % 2 != 1)
+                                throw LispException(p->ToString());
+                        while (!p->Second().IsNil()) {
+                                p = p->Second().AsPair();
+                                auto test = TranslateExpr(t, p->First());
+                                Emit(t, "if (" + test + " != kNil) {");
+                                t.depth++;
+                                TranslateTail(t, Nth(p, 1));
+                                t.depth--;
+                                Emit(t, "}");
+                                p = p->Second().AsPair();
+                        }
+                        Emit(t, "return (kNil);");
+                } else if (form == SpecialForm::None && first.IsSymbol() &&
+                           t.funs.count(first.AsSymbol()) &&
+                           t.funs[first.AsSymbol()] == t.fun &&
+                           n - 1 == t.params[t.fun].size()) {
+                        // A loop: rebind the parameters and start over.
+                        vector<string> args;
+                        for (Value e = p->Second();
+                             !e.IsNil();
+                             e = e.AsPair()->Second()) {
+                                auto x = TranslateExpr(t,
+                                                       e.AsPair()->First());
+                                auto r = Temp(t);
+                                Emit(t, "uint64_t " + r + " = " + x + ";");
+                                args.push_back(r);
+                        }
+                        for (size_t i = 0; i < args.size(); i++)
+                                Emit(t, 'a' + std::to_string(i) + " = " +
+                                     args[i] + ";");
+                        Emit(t, "goto top;");
+                        t.loops = true;
+                } else
+                        Emit(t, "return (" + TranslateExpr(t, e) + ");");
+        }
+
+        void DefPrim(const string& name, const PrimFun *fn, ...)
+        {
+                auto e = new PrimExpr(fn, "<primitive:" + name + '>');
+                DefGlobal(SymbolExpr::GetInstance(name), e);
+        }
+
+        void DefGlobal(const SymbolExpr *name, Value e)
+        {
+                Heap::GetInstance().Escape();
+                global_env_.define(name, e);
+        }
+
+        void InitGlobalEnv(void)
+        {
+                DefPrim("+", PrimPlus);
+                DefPrim("-", PrimMinus);
+                DefPrim("*", PrimMul);
+                DefPrim("/", PrimDiv);
+                DefPrim("CONS", PrimCons);
+                DefPrim("CAR", PrimCar);
+                DefPrim("CDR", PrimCdr);
+                DefPrim("NUMBER?", PrimIsNum);
+                DefPrim("SYMBOL?", PrimIsSym);
+                DefPrim("LIST?", PrimIsList);
+                DefPrim("NIL?", PrimIsNil);
+                DefPrim("AND?", PrimIsAnd);
+                DefPrim("OR?", PrimIsOr);
+                DefPrim("EQ?", PrimIsEq);
+                DefPrim("=", PrimIsEqNum);
+                DefPrim("<", PrimIsLtNum);
+                DefPrim(">", PrimIsGtNum);
+                DefPrim("MEMOIZE", PrimMemoize);
+                DefPrim("MEMO-STATS", PrimMemoStats);
+                DefPrim("PMAPCAR", PrimPmapcar);
+                DefPrim("PREDUCE", PrimPreduce);
+                DefPrim("FUTURE", PrimFuture);
+                DefPrim("TOUCH", PrimTouch);
+                DefPrim("LIST->VEC", PrimListToVec);
+                DefPrim("VEC-RANGE", PrimVecRange);
+                DefPrim("VEC->LIST", PrimVecToList);
+                DefPrim("VEC-LENGTH", PrimVecLength);
+                DefPrim("VEC-REF", PrimVecRef);
+                DefPrim("VEC?", PrimIsVec);
+                DefPrim("VEC+", PrimVecAdd);
+                DefPrim("VEC-", PrimVecSub);
+                DefPrim("VEC*", PrimVecMul);
+                DefPrim("VEC/", PrimVecDiv);
+                DefPrim("VEC<", PrimVecLess);
+                DefPrim("VEC>", PrimVecGreater);
+                DefPrim("VEC=", PrimVecEqual);
+                DefPrim("VEC-SCALE", PrimVecScale);
+                DefPrim("VEC-SUM", PrimVecSum);
+                DefPrim("VEC-MIN", PrimVecMin);
+                DefPrim("VEC-MAX", PrimVecMax);
+                DefPrim("VEC-DOT", PrimVecDot);
+                DefPrim("MAKE-HASH", PrimMakeHash);
+                DefPrim("HASH-GET", PrimHashGet);
+                DefPrim("HASH-SET!", PrimHashSet);
+                DefPrim("HASH-REMOVE!", PrimHashRemove);
+                DefPrim("HASH-COUNT", PrimHashCount);
+                DefPrim("HASH-KEYS", PrimHashKeys);
+                DefPrim("HASH->LIST", PrimHashToList);
+                DefPrim("HASH-FOR-EACH", PrimHashForEach);
+                DefPrim("HASH?", PrimIsHash);
+                DefPrim("STRING?", PrimIsString);
+                DefPrim("STRING-LENGTH", PrimStringLength);
+                DefPrim("SUBSTRING", PrimSubstring);
+                DefPrim("STRING-APPEND", PrimStringAppend);
+                DefPrim("STRING=", PrimStringEqual);
+                DefPrim("STRING-SPLIT", PrimStringSplit);
+                DefPrim("STRING-JOIN", PrimStringJoin);
+                DefPrim("STATS", PrimStats);
+                DefPrim("ROOM", PrimRoom);
+        }
+
+        const bool IsList(const PairExpr *p, size_t& len)
+        {
+                len = 1;
+                while (p->Second().Type() == ExprKind::Pair) {
+                        len++;
+                        p = p->Second().AsPair();
+                }
+
+                return (p->Second().IsNil());
+        }
+
+        const void AssertList(const PairExpr *p, size_t n)
+        {
+                size_t m;
+
+                if (IsList(p, m) && m == n)
+                        return;
+
+                throw LispException(p->ToString());
+        }
+
+        Value Nth(const PairExpr *p, size_t n)
+        {
+                while (n--)
+                        p = p->Second().AsPair();
+
+                return (p->First());
+        }
+
+        const vector<const SymbolExpr *>
+        FunParams(Value args)
+        {
+                vector<const SymbolExpr *> params;
+
+                while (!args.IsNil()) {
+                        auto p = PairCast(args);
                         params.push_back(SymbolCast(p->First()));
                         args = p->Second();
                 }
 
-                return (params);
+                return (params);
+        }
+
+        const FunExpr *
+        MakeFunction(const vector<const SymbolExpr *>& params,
+                     Value body,
+                     const SymbolExpr *name)
+        {
+
+                return (new FunExpr(params, body, Compile(body, params),
+                                    name));
+        }
+
+        // Returns the code to evaluate in place of e in the body of a
+        // function with the given parameters.  The references to the
+        // parameters become slots and the nested LAMBDAs are compiled ahead,
+        // the rest is shared with e.  Quoted data, nested DEFINEs, PROFILEs
+        // and TIMEs, whose expression is run afresh and refers to the
+        // parameters by name, and the malformed forms are left untouched:
+        // the latter fail when evaluated as they always did.
+        Value Compile(Value e, const vector<const SymbolExpr *>& params)
+        {
+                size_t n;
+
+                if (e.IsSymbol()) {
+                        for (size_t i = 0; i < params.size(); i++)
+                                if (params[i] == e.AsSymbol())
+                                        return (new LocalRefExpr(
+                                                        i, e.AsSymbol()));
+                        return (e);
+                }
+
+                if (e.Type() != ExprKind::Pair || !IsList(e.AsPair(), n))
+                        return (e);
+
+                auto p = e.AsPair();
+                auto first = p->First();
+                switch (first.IsSymbol() ? first.AsSymbol()->Special() :
+                        SpecialForm::None) {
+                case SpecialForm::Quote:
+                case SpecialForm::Define:
+                case SpecialForm::Profile:
+                case SpecialForm::Time:
+                        return (e);
+                case SpecialForm::Lambda:
+                        try {
+                                if (n == 3)
+                                        return (MakeFunction(
+                                                        FunParams(Nth(p, 1)),
+                                                        Nth(p, 2), NULL));
+                        } catch (const LispException&) {
+                        }
+                        return (e);
+                case SpecialForm::Set:
+                        // The variable set is always a global one.
+                        return (CompileList(p, params, 2));
+                case SpecialForm::None:
+                        return (CompileList(p, params, 0));
+                default:
+                        return (CompileList(p, params, 1));
+                }
+        }
+
+        // Compiles the elements of a proper list from the given one on.
+        Value CompileList(const PairExpr *p,
+                          const vector<const SymbolExpr *>& params,
+                          size_t from)
+        {
+                vector<Value> elems;
+                bool changed = false;
+
+                for (Value e = p; !e.IsNil(); e = e.AsPair()->Second()) {
+                        auto elem = e.AsPair()->First();
+                        if (elems.size() >= from) {
+                                auto code = Compile(elem, params);
+                                changed |= code != elem;
+                                elem = code;
+                        }
+                        elems.push_back(elem);
+                }
+
+                if (!changed)
+                        return (p);
+
+                Value l = kNil;
+                for (size_t i = elems.size(); i-- > 0; )
+                        l = new PairExpr(elems[i], l);
+
+                return (l);
         }
 
-        const LispExprInterface *
-        Apply(const LispExprInterface *e,
-              vector<const LispExprInterface *>& args,
-              Env& env)
+        // Returns the function e, checked to take nargs arguments.
+        const FunExpr *FunCast(Value e, size_t nargs)
         {
 
-                if (e->Type() == ExprKind::Primitive) {
-                        auto fn = (static_cast<const PrimExpr *>(e))->Impl();
-                        return (fn(args));
-                }
-
-                if (e->Type() != ExprKind::Function)
+                if (e.Type() != ExprKind::Function)
                         throw LispException(
-                                "Not a procedure: " + e->ToString());
+                                "Not a procedure: " + e.ToString());
 
-                Env newenv(&env);
-                auto fn = static_cast<const FunExpr *>(e);
-                auto params = fn->params();
+                auto fn = static_cast<const FunExpr *>(e.AsObject());
+                auto& params = fn->params();
                 auto name = fn->name();
-                if (args.size() != params.size()) {
+                if (nargs != params.size()) {
                         std::ostringstream ss;
                         if (name == NULL)
                                 ss << "<procedure>";
                         else
                                 ss << name->ToString();
-                        ss << ": given " << args.size() <<
+                        ss << ": given " << nargs <<
                                 " arguments instead of " <<
                                 params.size() << '.';
                         throw LispException(ss.str());
                 }
 
-                for (size_t i = 0; i < args.size(); i++)
-                        newenv.define(params[i], args[i]);
-
-                return (Evaluate(fn->body(), newenv));
+                return (fn);
         }
 
-        const LispExprInterface *EvalList(const PairExpr *p, Env& env)
+        // Replaces the frame of the running function by the frame of its
+        // tail call to fn.  Under dynamic scope the callee still sees the
+        // bindings of its caller, so those it does not shadow are kept
+        // behind its parameters: the frame grows with the distinct names a
+        // loop binds, never with its iterations.  The arguments are left in
+        // args, which the call may reuse.
+        void TailCall(Env& frame,
+                      const FunExpr *fn,
+                      vector<Value>& args,
+                      vector<const SymbolExpr *>& names,
+                      vector<Value>& slots,
+                      vector<const SymbolExpr *>& scratch)
         {
-                if (StartsWith(p, "IF")) {
-                        AssertList(p, 4);
-                        auto e = Evaluate(Nth(p, 1), env);
-                        if (e->Type() == ExprKind::Nil)
-                                e = Nth(p, 3);
-                        else
-                                e = Nth(p, 2);
-                        return (Evaluate(e, env));
-                }
+                auto& params = fn->params();
+                size_t i;
 
-                if (StartsWith(p, "COND")) {
-                        size_t n;
-                        if (!IsList(p, n) || n == 1 || n % 2 != 1)
-                                throw LispException(p->ToString());
+                // A function calling itself binds the same names again.
+                for (i = 0; i < params.size(); i++)
+                        if (i >= frame.Size() || frame.Name(i) != params[i])
+                                break;
+                if (i == params.size()) {
+                        std::copy(args.begin(), args.end(), slots.begin());
+                        return;
+                }
 
-                        for (;;) {
-                                p = static_cast<const PairExpr *>(p->Second());
-                                if (p->Type() == ExprKind::Nil)
-                                        break;
-                                auto e = Evaluate(p->First(), env);
-                                if (e->Type() != ExprKind::Nil)
-                                        return Evaluate(Nth(p, 1), env);
-                                p = static_cast<const PairExpr *>(p->Second());
+                UnbindFrame(global_env_, frame);
+                scratch.assign(params.begin(), params.end());
+                for (i = 0; i < frame.Size(); i++) {
+                        auto name = frame.Name(i);
+                        if (std::find(params.begin(), params.end(), name) ==
+                            params.end()) {
+                                scratch.push_back(name);
+                                args.push_back(frame.Slot(i));
                         }
-                        return (kNil);
                 }
+                names.swap(scratch);
+                slots.swap(args);
+                frame = Env(names, slots, frame.Next());
+                BindFrame(global_env_, frame);
+        }
 
-                if (StartsWith(p, "SET")) {
-                        AssertList(p, 3);
-                        auto name = SymbolCast(Nth(p, 1));
-                        auto e = Evaluate(Nth(p, 2), env);
-                        global_env_.define(name, e);
-                        return (e);
+        // Returns the bytecode of the body of fn, compiled on its first run.
+        const Chunk *ChunkOf(const FunExpr *fn)
+        {
+
+                auto chunk = fn->chunk();
+
+                if (chunk == NULL) {
+                        std::unique_ptr<Chunk> code(new Chunk());
+                        EmitCode(*code, fn->code(), true);
+                        chunk = fn->set_chunk(code.release());
                 }
+                return (chunk);
+        }
 
-                if (StartsWith(p, "QUOTE")) {
-                        AssertList(p, 2);
-                        // Don't evaluate the argument.
-                        return (Nth(p, 1));
+        // Appends the code of e to chunk.  The code of an expression in tail
+        // position returns its value, the code of any other one pushes it.
+        void EmitCode(Chunk& chunk, Value e, bool tail)
+        {
+                size_t n;
+
+                switch (e.Type()) {
+                case ExprKind::Local:
+                        chunk.Emit(Op::Local,
+                                   static_cast<const LocalRefExpr *>(
+                                           e.AsObject())->Slot());
+                        break;
+                case ExprKind::Symbol:
+                        chunk.Emit(Op::Var, chunk.AddConst(e));
+                        break;
+                case ExprKind::Pair:
+                        if (IsList(e.AsPair(), n)) {
+                                EmitForm(chunk, e.AsPair(), n, tail);
+                                return;
+                        }
+                        chunk.Emit(Op::Tree, chunk.AddConst(e));
+                        break;
+                default:
+                        chunk.Emit(Op::Const, chunk.AddConst(e));
+                        break;
                 }
 
-                if (StartsWith(p, "DEFINE")) {
-                        AssertList(p, 4);
-                        auto name = SymbolCast(Nth(p, 1));
-                        auto params = FunParams(Nth(p, 2));
-                        auto body = Nth(p, 3);
+                if (tail)
+                        chunk.Emit(Op::Return);
+        }
 
-                        global_env_.define(
-                                name,
-                                new FunExpr(params, body, name));
+        // Appends the code of the form p, a list of n elements.  The forms
+        // that define functions, PROFILE, TIME, and the malformed ones, are
+        // left to the tree walker so that they behave, and fail, as they do
+        // there.
+        void EmitForm(Chunk& chunk, const PairExpr *p, size_t n, bool tail)
+        {
+                auto first = p->First();
+                auto form = first.IsSymbol() ? first.AsSymbol()->Special() :
+                        SpecialForm::None;
 
-                        return (kNil);
+                switch (form) {
+                case SpecialForm::If: {
+                        if (n != 4)
+                                break;
+                        EmitCode(chunk, Nth(p, 1), false);
+                        auto other = chunk.Emit(Op::JumpIfNil);
+                        EmitCode(chunk, Nth(p, 2), tail);
+                        size_t done = tail ? 0 : chunk.Emit(Op::Jump);
+                        chunk.Patch(other, chunk.Size());
+                        EmitCode(chunk, Nth(p, 3), tail);
+                        if (!tail)
+                                chunk.Patch(done, chunk.Size());
+                        return;
+                }
+                case SpecialForm::Cond: {
+                        if (n == 1 || n % 2 != 1)
+                                break;
+                        vector<size_t> done;
+                        while (!p->Second().IsNil()) {
+                                p = p->Second().AsPair();
+                                EmitCode(chunk, p->First(), false);
+                                auto next = chunk.Emit(Op::JumpIfNil);
+                                EmitCode(chunk, Nth(p, 1), tail);
+                                if (!tail)
+                                        done.push_back(chunk.Emit(Op::Jump));
+                                chunk.Patch(next, chunk.Size());
+                                p = p->Second().AsPair();
+                        }
+                        EmitCode(chunk, kNil, tail);
+                        for (auto at: done)
+                                chunk.Patch(at, chunk.Size());
+                        return;
+                }
+                case SpecialForm::Set:
+                        if (n != 3 || !Nth(p, 1).IsSymbol())
+                                break;
+                        EmitCode(chunk, Nth(p, 2), false);
+                        chunk.Emit(Op::Set, chunk.AddConst(Nth(p, 1)));
+                        if (tail)
+                                chunk.Emit(Op::Return);
+                        return;
+                case SpecialForm::Quote:
+                        if (n != 2)
+                                break;
+                        chunk.Emit(Op::Const, chunk.AddConst(Nth(p, 1)));
+                        if (tail)
+                                chunk.Emit(Op::Return);
+                        return;
+                case SpecialForm::Apply:
+                        if (n != 3)
+                                break;
+                        EmitCode(chunk, Nth(p, 1), false);
+                        EmitCode(chunk, Nth(p, 2), false);
+                        // A primitive returns here.
+                        if (tail) {
+                                chunk.Emit(Op::TailApply);
+                                chunk.Emit(Op::Return);
+                        } else
+                                chunk.Emit(Op::Apply);
+                        return;
+                case SpecialForm::Eval:
+                        if (n != 2)
+                                break;
+                        EmitCode(chunk, Nth(p, 1), false);
+                        chunk.Emit(Op::Eval);
+                        if (tail)
+                                chunk.Emit(Op::Return);
+                        return;
+                case SpecialForm::Define:
+                case SpecialForm::Lambda:
+                case SpecialForm::Profile:
+                case SpecialForm::Time:
+                        break;
+                case SpecialForm::None:
+                        for (Value e = p; !e.IsNil(); e = e.AsPair()->Second())
+                                EmitCode(chunk, e.AsPair()->First(), false);
+                        if (tail) {
+                                chunk.Emit(Op::TailCall, n - 1);
+                                chunk.Emit(Op::Return);
+                        } else
+                                chunk.Emit(Op::Call, n - 1);
+                        return;
                 }
 
-                if (StartsWith(p, "LAMBDA")) {
-                        AssertList(p, 3);
-                        auto params = FunParams(Nth(p, 1));
-                        auto body = Nth(p, 2);
+                chunk.Emit(Op::Tree, chunk.AddConst(p));
+                if (tail)
+                        chunk.Emit(Op::Return);
+        }
+
+        // Runs chunk on the bytecode machine.  A call pushes a frame on the
+        // machine instead of recursing in C++, and a call in tail position
+        // replaces the frame of the running function as in Evaluate().  EVAL
+        // hands the expressions built at run time to the tree walker.
+        Value Execute(const Chunk *chunk, const Env *env)
+        {
+                auto& stack = vm_.Stack();
+                auto& args = vm_.Args();
+                size_t depth = vm_.Depth(), height = stack.size();
+                size_t profiled = profiler_ != NULL ? profiler_->Depth() : 0;
+                auto f = vm_.Push(chunk, env);
+                auto code = chunk->Code();
+                auto consts = chunk->Consts();
+                size_t pc = 0;
+                size_t executed = 0;
 
-                        return (new FunExpr(params, body));
+                try {
+                        for (;;) {
+                                uint32_t insn = code[pc++];
+                                executed++;
+                                size_t k = insn >> 8;
+                                auto op = static_cast<Op>(insn & 0xff);
+                                size_t n = k;
+
+                                switch (op) {
+                                case Op::Const:
+                                        stack.push_back(consts[k]);
+                                        continue;
+                                case Op::Local:
+                                        stack.push_back(f->slots[k]);
+                                        continue;
+                                case Op::Var:
+                                        stack.push_back(EvalVar(
+                                                consts[k].AsSymbol(), f->env));
+                                        continue;
+                                case Op::Set:
+                                        DefGlobal(consts[k].AsSymbol(),
+                                                  stack.back());
+                                        continue;
+                                case Op::Jump:
+                                        pc = k;
+                                        continue;
+                                case Op::JumpIfNil:
+                                        if (stack.back().IsNil())
+                                                pc = k;
+                                        stack.pop_back();
+                                        continue;
+                                case Op::Eval: {
+                                        auto e = Evaluate(stack.back(),
+                                                          f->env);
+                                        stack.back() = e;
+                                        continue;
+                                }
+                                case Op::Tree: {
+                                        auto e = Evaluate(consts[k], f->env);
+                                        stack.push_back(e);
+                                        continue;
+                                }
+                                case Op::Return: {
+                                        auto e = stack.back();
+                                        if (!f->memo.IsNil())
+                                                static_cast<const MemoExpr *>(
+                                                        f->memo.AsObject())->
+                                                        Store(f->key, e);
+                                        stack.resize(f->base);
+                                        if (f->env == &f->frame)
+                                                UnbindFrame(global_env_,
+                                                            f->frame);
+                                        if (f->profiled)
+                                                profiler_->Leave();
+                                        vm_.Pop();
+                                        if (vm_.Depth() == depth) {
+                                                counters_.instructions +=
+                                                        executed;
+                                                if (depth == 0)
+                                                        vm_.Stop();
+                                                return (e);
+                                        }
+                                        f = vm_.Top();
+                                        code = f->chunk->Code();
+                                        consts = f->chunk->Consts();
+                                        pc = f->pc;
+                                        stack.push_back(e);
+                                        continue;
+                                }
+                                case Op::Apply:
+                                case Op::TailApply: {
+                                        // Nothing allocates while the list
+                                        // is off the stack.
+                                        auto l = stack.back();
+                                        stack.pop_back();
+                                        for (n = 0; !l.IsNil(); n++) {
+                                                auto p = PairCast(l);
+                                                stack.push_back(p->First());
+                                                l = p->Second();
+                                        }
+                                        break;
+                                }
+                                case Op::Call:
+                                case Op::TailCall:
+                                        break;
+                                }
+
+                                auto callee = stack[stack.size() - n - 1];
+                                auto tail = op == Op::TailCall ||
+                                        op == Op::TailApply;
+                                Value memo;
+                                args.assign(stack.end() - n, stack.end());
+                                if (callee.Type() == ExprKind::Memo) {
+                                        auto m = static_cast<
+                                                const MemoExpr *>(
+                                                        callee.AsObject());
+                                        Value v;
+                                        if (m->Find(args, v)) {
+                                                stack.resize(
+                                                        stack.size() - n - 1);
+                                                stack.push_back(v);
+                                                continue;
+                                        }
+                                        // The function runs in a frame of its
+                                        // own, that stores its value.
+                                        memo = callee;
+                                        callee = m->fn();
+                                        tail = false;
+                                }
+                                if (callee.Type() == ExprKind::Primitive) {
+                                        // A primitive calling back reuses
+                                        // args: the key is kept apart.
+                                        vector<Value> key;
+                                        if (!memo.IsNil())
+                                                key = args;
+                                        auto e = CallPrimitive(callee, args,
+                                                               f->env);
+                                        if (!memo.IsNil())
+                                                static_cast<const MemoExpr *>(
+                                                        memo.AsObject())->
+                                                        Store(key, e);
+                                        stack.resize(stack.size() - n - 1);
+                                        stack.push_back(e);
+                                        continue;
+                                }
+
+                                auto fn = FunCast(callee, n);
+                                auto next = ChunkOf(fn);
+                                if (!tail) {
+                                        f->pc = pc;
+                                        f = vm_.Push(next, f->env);
+                                        counters_.Reach(counters_.depth +
+                                                        vm_.Depth());
+                                        f->memo = memo;
+                                        if (!memo.IsNil())
+                                                f->key = args;
+                                } else
+                                        f->chunk = next;
+                                // The frame roots the function from here.
+                                f->fn = callee;
+                                if (profiler_ != NULL) {
+                                        if (f->profiled)
+                                                profiler_->Leave();
+                                        profiler_->Enter(callee);
+                                        f->profiled = true;
+                                }
+                                stack.resize(stack.size() - n - 1);
+                                f->base = stack.size();
+                                counters_.frames++;
+                                if (f->env == &f->frame) {
+                                        TailCall(f->frame, fn, args, f->names,
+                                                 f->slots, f->scratch);
+                                } else {
+                                        f->names.assign(fn->params().begin(),
+                                                        fn->params().end());
+                                        f->slots.swap(args);
+                                        f->frame = Env(f->names, f->slots,
+                                                       f->env);
+                                        f->env = &f->frame;
+                                        BindFrame(global_env_, f->frame);
+                                }
+                                code = next->Code();
+                                consts = next->Consts();
+                                pc = 0;
+
+                                // Everything live is on the machine: this is
+                                // a safepoint.
+                                Heap::GetInstance().MaybeCollect();
+                        }
+                } catch (...) {
+                        while (vm_.Depth() > depth) {
+                                f = vm_.Top();
+                                if (f->env == &f->frame)
+                                        UnbindFrame(global_env_, f->frame);
+                                vm_.Pop();
+                        }
+                        vm_.Unwind(depth, height);
+                        if (depth == 0)
+                                vm_.Stop();
+                        if (profiler_ != NULL)
+                                profiler_->Unwind(profiled);
+                        counters_.instructions += executed;
+                        throw;
                 }
+        }
 
-                if (StartsWith(p, "APPLY")) {
-                        AssertList(p, 3);
-                        auto fn = Evaluate(Nth(p, 1), env);
-                        auto l = Evaluate(Nth(p, 2), env);
-                        vector<const LispExprInterface *> args;
+        // Calls the function of memo on args unless it remembers its value.
+        // The caller roots memo and args.
+        Value CallMemo(const MemoExpr *memo, vector<Value>& args,
+                       const Env *env)
+        {
+                Value result;
 
-                        while (l->Type() != ExprKind::Nil) {
-                                auto p = PairCast(l);
-                                args.push_back(p->First());
-                                l = p->Second();
-                        }
-                        return (Apply(fn, args, env));
+                if (memo->Find(args, result))
+                        return (result);
+                result = Apply(memo->fn(), args, env);
+                memo->Store(args, result);
+                return (result);
+        }
+
+        // Calls fn on args from outside of the code being run, the callee
+        // seeing the bindings of env.  The caller roots fn and args.
+        Value Apply(Value fn, vector<Value>& args, const Env *env)
+        {
+
+                if (fn.Type() == ExprKind::Primitive)
+                        return (CallPrimitive(fn, args, env));
+                if (fn.Type() == ExprKind::Memo)
+                        return (CallMemo(static_cast<const MemoExpr *>(
+                                                 fn.AsObject()),
+                                         args, env));
+
+                auto f = FunCast(fn, args.size());
+                if (engine_ == Engine::Bytecode) {
+                        Chunk chunk;
+                        chunk.Emit(Op::Const, chunk.AddConst(fn));
+                        for (auto e: args)
+                                chunk.Emit(Op::Const, chunk.AddConst(e));
+                        chunk.Emit(Op::TailCall, args.size());
+                        chunk.Emit(Op::Return);
+                        return (Execute(&chunk, env));
                 }
 
-                if (StartsWith(p, "EVAL")) {
-                        AssertList(p, 2);
-                        auto e = Evaluate(Nth(p, 1), env);
-                        return (Evaluate(e, env));
+                vector<const SymbolExpr *> names(f->params());
+                vector<Value> slots(args);
+                GcRoot slots_root(&slots);
+                Env frame(names, slots, env);
+                FrameGuard guard(global_env_);
+                guard.Bind(&frame);
+                counters_.frames++;
+                Profiler::Scope profiled(profiler_.get());
+                profiled.Call(fn);
+                Heap::GetInstance().MaybeCollect();
+                return (Evaluate(f->code(), &frame));
+        }
+
+        // Evaluates e on the engine of the interpreter, with the bindings of
+        // env, and reports the calls it made on std::cerr and in
+        // kFoldedStacks.  Within another profile, e is counted in it.
+        Value Profile(Value e, const Env *env)
+        {
+                Value result;
+
+                if (profiler_ != NULL)
+                        return (Run(e, env));
+                StartProfiling();
+                try {
+                        result = Run(e, env);
+                } catch (...) {
+                        profiler_.reset();
+                        throw;
                 }
+                StopProfiling(std::cerr, kFoldedStacks);
+                return (result);
+        }
+
+        // Evaluates e like Profile(), and reports on std::cerr the time it
+        // took, the objects it allocated and the steps it ran: the
+        // invocations of Evaluate() and the instructions executed.
+        Value Time(Value e, const Env *env)
+        {
+                size_t allocations = Heap::GetInstance().Allocations();
+                size_t steps = counters_.evaluations + counters_.instructions;
+                auto start = std::chrono::steady_clock::now();
+
+                auto result = Run(e, env);
+                std::chrono::duration<double, std::milli> elapsed =
+                        std::chrono::steady_clock::now() - start;
+                std::cerr << std::fixed << std::setprecision(3) <<
+                        elapsed.count() << std::defaultfloat << " ms, " <<
+                        Heap::GetInstance().Allocations() - allocations <<
+                        " allocations, " << counters_.evaluations +
+                        counters_.instructions - steps << " steps." <<
+                        std::endl;
+                return (result);
+        }
+
+        Value Run(Value e, const Env *env)
+        {
 
-                auto fn = Evaluate(p->First(), env);
-                vector<const LispExprInterface *> args;
-                for (auto e = p->Second();
-                     e->Type() != ExprKind::Nil;
-                     e = p->Second()) {
-                        p = PairCast(e);
-                        args.push_back(Evaluate(p->First(), env));
+                if (engine_ == Engine::Bytecode) {
+                        Chunk chunk;
+                        EmitCode(chunk, e, true);
+                        return (Execute(&chunk, env));
                 }
+                return (Evaluate(e, env));
+        }
 
-                return (Apply(fn, args, env));
+        // Calls the primitive prim on args, the callee seeing the bindings
+        // of env.
+        Value CallPrimitive(Value prim, vector<Value>& args, const Env *env)
+        {
+                auto p = static_cast<const PrimExpr *>(prim.AsObject());
+
+                caller_env_ = env;
+                if (profiler_ == NULL)
+                        return (p->Call(args));
+                Profiler::Scope profiled(profiler_.get());
+                profiled.Call(prim);
+                return (p->Call(args));
         }
 
-        const LispExprInterface *EvalVar(const SymbolExpr *s, Env& env)
+        Value EvalVar(const SymbolExpr *s, const Env *env)
         {
-                auto e = env.lookup(s);
+                const Value *e = NULL;
+
+                // Most references, those to the primitives and the functions
+                // in particular, are to symbols no frame binds.
+                if (env != NULL && global_env_.shadowed(s))
+                        e = env->lookup(s);
+                if (e == NULL)
+                        e = global_env_.lookup(s);
 
                 if (e)
-                        return (e);
+                        return (*e);
                 throw LispException("Unbound variable: " + s->ToString());
         }
 
-        const LispExprInterface *
-        Evaluate(const LispExprInterface *e, Env& env)
+        // The branches and the calls in tail position replace the
+        // expression being evaluated instead of recursing, so that a loop
+        // written as a tail recursion runs in constant space.
+        Value
+        Evaluate(Value e, const Env *env)
         {
-                switch (e->Type()) {
-                case ExprKind::Num:
-                case ExprKind::String:
-                case ExprKind::Nil:
-                case ExprKind::True:
-                        return (e);
-                        break;
-                case ExprKind::Pair:
-                        return (EvalList(static_cast<const PairExpr *>(e),
-                                         env));
-                        break;
-                case ExprKind::Symbol:
-                        return (EvalVar(static_cast<const SymbolExpr *>(e),
-                                        env));
-                        break;
-                default:
-                        throw LispException(
-                                "Unexpected expression: " + e->ToString());
-                        break;
-                }
+                // The frame of the function this invocation runs: its first
+                // call chains it to env, the calls after it reuse it.
+                Env frame;
+                vector<const SymbolExpr *> names, scratch;
+                vector<Value> slots, args;
+                // The function running and the one being called.
+                Value fn, callee;
+                GcRoot e_root(&e), fn_root(&fn), callee_root(&callee);
+                GcRoot slots_root(&slots), args_root(&args);
+                FrameGuard guard(global_env_);
+                Profiler::Scope profiled(profiler_.get());
+                Nesting nesting(*this);
 
-                return (NULL);
+                for (;;) {
+                        switch (e.Type()) {
+                        case ExprKind::Num:
+                        case ExprKind::String:
+                        case ExprKind::Nil:
+                        case ExprKind::True:
+                        // The lambdas nested in a compiled body are compiled
+                        // ahead.
+                        case ExprKind::Function:
+                        case ExprKind::Future:
+                        case ExprKind::Hash:
+                        case ExprKind::Memo:
+                        case ExprKind::Primitive:
+                        case ExprKind::Vector:
+                                return (e);
+                                break;
+                        case ExprKind::Local:
+                                return (env->Slot(
+                                        static_cast<const LocalRefExpr *>(
+                                                e.AsObject())->Slot()));
+                                break;
+                        case ExprKind::Pair:
+                                break;
+                        case ExprKind::Symbol:
+                                return (EvalVar(e.AsSymbol(), env));
+                                break;
+                        default:
+                                throw LispException(
+                                        "Unexpected expression: " +
+                                        e.ToString());
+                                break;
+                        }
+
+                        auto p = e.AsPair();
+                        auto first = p->First();
+                        auto form = first.IsSymbol() ?
+                                first.AsSymbol()->Special() :
+                                SpecialForm::None;
+
+                        args.clear();
+                        switch (form) {
+                        case SpecialForm::If: {
+                                AssertList(p, 4);
+                                if (Evaluate(Nth(p, 1), env).IsNil())
+                                        e = Nth(p, 3);
+                                else
+                                        e = Nth(p, 2);
+                                continue;
+                        }
+                        case SpecialForm::Cond: {
+                                size_t n;
+                                if (!IsList(p, n) || n == 1 || n % 2 != 1)
+                                        throw LispException(p->ToString());
+
+                                e = kNil;
+                                while (!p->Second().IsNil()) {
+                                        p = p->Second().AsPair();
+                                        if (!Evaluate(p->First(),
+                                                      env).IsNil()) {
+                                                e = Nth(p, 1);
+                                                break;
+                                        }
+                                        p = p->Second().AsPair();
+                                }
+                                continue;
+                        }
+                        case SpecialForm::Set: {
+                                AssertList(p, 3);
+                                auto name = SymbolCast(Nth(p, 1));
+                                auto e = Evaluate(Nth(p, 2), env);
+                                DefGlobal(name, e);
+                                return (e);
+                        }
+                        case SpecialForm::Quote: {
+                                AssertList(p, 2);
+                                // Don't evaluate the argument.
+                                return (Nth(p, 1));
+                        }
+                        case SpecialForm::Define: {
+                                AssertList(p, 4);
+                                auto name = SymbolCast(Nth(p, 1));
+                                auto params = FunParams(Nth(p, 2));
+                                auto body = Nth(p, 3);
+
+                                DefGlobal(name,
+                                          MakeFunction(params, body, name));
+
+                                return (kNil);
+                        }
+                        case SpecialForm::Lambda: {
+                                AssertList(p, 3);
+                                auto params = FunParams(Nth(p, 1));
+                                auto body = Nth(p, 2);
+
+                                return (MakeFunction(params, body, NULL));
+                        }
+                        case SpecialForm::Apply: {
+                                AssertList(p, 3);
+                                callee = Evaluate(Nth(p, 1), env);
+                                auto l = Evaluate(Nth(p, 2), env);
+
+                                while (!l.IsNil()) {
+                                        auto p = PairCast(l);
+                                        args.push_back(p->First());
+                                        l = p->Second();
+                                }
+                                break;
+                        }
+                        case SpecialForm::Eval: {
+                                AssertList(p, 2);
+                                e = Evaluate(Nth(p, 1), env);
+                                continue;
+                        }
+                        case SpecialForm::Profile:
+                                AssertList(p, 2);
+                                return (Profile(Nth(p, 1), env));
+                        case SpecialForm::Time:
+                                AssertList(p, 2);
+                                return (Time(Nth(p, 1), env));
+                        case SpecialForm::None:
+                                callee = Evaluate(p->First(), env);
+                                for (auto e = p->Second();
+                                     !e.IsNil();
+                                     e = p->Second()) {
+                                        p = PairCast(e);
+                                        args.push_back(
+                                                Evaluate(p->First(), env));
+                                }
+                                break;
+                        }
+
+                        if (callee.Type() == ExprKind::Primitive)
+                                return (CallPrimitive(callee, args, env));
+                        if (callee.Type() == ExprKind::Memo)
+                                return (CallMemo(static_cast<const MemoExpr *>(
+                                                         callee.AsObject()),
+                                                 args, env));
+
+                        auto f = FunCast(callee, args.size());
+                        counters_.frames++;
+                        if (env == &frame) {
+                                TailCall(frame, f, args, names, slots,
+                                         scratch);
+                        } else {
+                                names.assign(f->params().begin(),
+                                             f->params().end());
+                                slots.swap(args);
+                                frame = Env(names, slots, env);
+                                env = &frame;
+                                guard.Bind(&frame);
+                        }
+                        fn = callee;
+                        e = f->code();
+                        profiled.Call(callee);
+
+                        // Everything live is rooted above: this is a
+                        // safepoint.
+                        Heap::GetInstance().MaybeCollect();
+                }
         }
 };
 
-void RunTests(void)
+thread_local SimpleLispInterpreter *SimpleLispInterpreter::loading_ = NULL;
+thread_local SimpleLispInterpreter *SimpleLispInterpreter::running_ = NULL;
+
+// Prints the tests on log, and the values they evaluate to on out.
+void RunTests(Engine engine, std::ostream& log = std::cerr,
+              std::ostream& out = std::cout)
 {
         std::ifstream is("lisp.test");
-        SimpleLispInterpreter interp;        
+        SimpleLispInterpreter interp(engine);        
         string line;
         string input;        
 
@@ -953,20 +6646,20 @@ void RunTests(void)
                 switch (line[0]) {
                 case '<':
                         input = line.substr(1);                        
-                        std::cerr << "Evaluating: " << input << std::endl;
-                        std::cerr << "--> ";                        
+                        log << "Evaluating: " << input << std::endl;
+                        log << "--> ";                        
                         try {
-                                interp.Process(input);
+                                interp.Process(input, out);
                         } catch (const std::exception &e) {
-                                std::cerr << "Error: " << e.what() << std::endl;
+                                log << "Error: " << e.what() << std::endl;
                         }
                         break;
                 case '>':
-                        std::cerr << "Expected output: " << line.substr(1) <<
+                        log << "Expected output: " << line.substr(1) <<
                                 std::endl;                        
                         break;
                 default:
-                        std::cerr << line << std::endl;
+                        log << line << std::endl;
                         break;                        
                 }
         }
@@ -974,29 +6667,635 @@ void RunTests(void)
         is.close();        
 }
 
+// Runs the tests in n interpreters at once, each on a thread of its own,
+// and checks that every one of them prints what a single one does.
+// Returns the number of those that didn't.
+size_t StressTests(Engine engine, size_t n)
+{
+        std::ostringstream expected;
+        vector<string> outputs(n);
+        vector<std::thread> threads;
+
+        RunTests(engine, expected, expected);
+        for (size_t i = 0; i < n; i++)
+                threads.emplace_back([engine, &outputs, i]() {
+                        std::ostringstream os;
+
+                        RunTests(engine, os, os);
+                        outputs[i] = os.str();
+                });
+        for (auto& t: threads)
+                t.join();
+
+        size_t failed = 0;
+        for (size_t i = 0; i < n; i++) {
+                if (outputs[i] == expected.str())
+                        continue;
+                if (failed++ != 0)
+                        continue;
+
+                // Shows where the first one that failed went wrong.
+                std::istringstream want(expected.str()), got(outputs[i]);
+                string a, b;
+                while (std::getline(want, a) && std::getline(got, b) &&
+                       a == b)
+                        ;
+                std::cerr << "Interpreter " << i << " printed: " << b <<
+                        std::endl << "instead of: " << a << std::endl;
+        }
+        std::cerr << n << " interpreters run, " << failed << " failed." <<
+                std::endl;
+        return (failed);
+}
+
+// A case of a test file: a line "<input" and the line ">expected" after it.
+struct TestCase {
+        size_t line;
+        string input;
+        string expected;
+};
+
+vector<TestCase> ReadTests(const string& path)
+{
+        std::ifstream is(path);
+        vector<TestCase> cases;
+        TestCase c = TestCase();
+        string line;
+
+        if (!is)
+                throw LispException(path + ": " + std::strerror(errno));
+        for (size_t n = 1; std::getline(is, line); n++) {
+                // The file may end its lines with CR LF.
+                if (!line.empty() && line.back() == '\r')
+                        line.pop_back();
+                if (!line.empty() && line[0] == '<') {
+                        c.line = n;
+                        c.input = line.substr(1);
+                } else if (!line.empty() && line[0] == '>' &&
+                           c.line != 0) {
+                        c.expected = line.substr(1);
+                        cases.push_back(c);
+                        c.line = 0;
+                }
+        }
+        return (cases);
+}
+
+// Whether a case printed what it expects: "Unspecified" stands for any
+// value, and "Error" for any error.
+bool Matches(const string& expected, const string& actual, bool failed)
+{
+
+        if (expected == "Unspecified")
+                return (!failed);
+        if (expected == "Error" || expected == "ERROR")
+                return (failed);
+        return (actual == expected);
+}
+
+// Runs the cases of the test file at path in order, in a single
+// interpreter since they build on each other, set up by setup, and times
+// each one.  Prints the cases that didn't print what they expect, and those
+// more than kSlowdown times and kSlack slower than in the timings of
+// baseline, unless empty.  Writes the timings to save, unless empty.
+// Returns the status to exit with: 0 unless a case failed or got slower.
+int RunConformance(Engine engine, const string& path,
+                   const std::function<void(SimpleLispInterpreter&)>& setup,
+                   const string& baseline, const string& save)
+{
+        static const double kSlowdown = 2;
+        static const double kSlack = 1e6;
+        auto cases = ReadTests(path);
+        // The time of each case, in nanoseconds, and its input.
+        vector<std::pair<double, string>> before, times;
+
+        if (!baseline.empty()) {
+                std::ifstream is(baseline);
+                string input;
+                double ns;
+                if (!is)
+                        throw LispException(baseline + ": " +
+                                            std::strerror(errno));
+                while (is >> ns && is.get() == ' ' &&
+                       std::getline(is, input))
+                        before.push_back(std::make_pair(ns, input));
+        }
+
+        SimpleLispInterpreter interp(engine);
+        setup(interp);
+        size_t failed = 0;
+        size_t slower = 0;
+        double total = 0;
+        for (size_t i = 0; i < cases.size(); i++) {
+                auto& c = cases[i];
+                std::ostringstream os;
+                bool error = false;
+
+                auto start = std::chrono::steady_clock::now();
+                try {
+                        interp.Process(c.input, os);
+                } catch (const std::exception &e) {
+                        os << "Error: " << e.what() << '\n';
+                        error = true;
+                }
+                std::chrono::duration<double, std::nano> elapsed =
+                        std::chrono::steady_clock::now() - start;
+                times.push_back(std::make_pair(elapsed.count(), c.input));
+                total += elapsed.count();
+
+                auto actual = os.str();
+                if (!actual.empty() && actual.back() == '\n')
+                        actual.pop_back();
+                if (!Matches(c.expected, actual, error)) {
+                        failed++;
+                        std::cout << path << ':' << c.line << ": " <<
+                                c.input << "\n-" << c.expected << "\n+" <<
+                                actual << std::endl;
+                }
+                // The baseline only applies to the cases it has the
+                // inputs of.
+                if (i < before.size() && before[i].second == c.input &&
+                    elapsed.count() > before[i].first * kSlowdown &&
+                    elapsed.count() - before[i].first > kSlack) {
+                        slower++;
+                        std::cout << path << ':' << c.line << ": " <<
+                                c.input << "\nslower: " << std::fixed <<
+                                std::setprecision(3) <<
+                                elapsed.count() / 1e6 << " ms instead of " <<
+                                before[i].first / 1e6 << " ms" << std::endl;
+                        std::cout.unsetf(std::ios::fixed);
+                }
+        }
+
+        if (!save.empty()) {
+                std::ofstream os(save);
+                for (auto& t: times)
+                        os << std::fixed << std::setprecision(0) <<
+                                t.first << ' ' << t.second << '\n';
+                if (!os)
+                        throw LispException(save + ": " +
+                                            std::strerror(errno));
+        }
+
+        std::cout << cases.size() << " cases, " << failed << " failed, " <<
+                slower << " slower, in " << std::fixed <<
+                std::setprecision(3) << total / 1e6 << " ms." << std::endl;
+        return (failed == 0 && slower == 0 ? 0 : 1);
+}
+
+// A workload of the benchmarks.  Its setup is evaluated once, then each
+// operation evaluates its input, and prints the value, or only reads it.
+struct Workload {
+        enum Kind { Eval, Read };
+
+        const char *name;
+        Kind kind;
+        string setup;
+        string input;
+        size_t ops;
+};
+
+// The text of a list of n symbols, all different.
+string SymbolsText(size_t n)
+{
+        string s = "(";
+
+        for (size_t i = 0; i < n; i++)
+                s += "symbol-" + std::to_string(i) + (i % 8 ? " " : "\n");
+        return (s + ')');
+}
+
+// The text of a quoted list of n numbers and strings.
+string LiteralText(size_t n)
+{
+        string s = "'(";
+
+        for (size_t i = 0; i < n; i++)
+                s += (i % 3 == 0 ? std::to_string(i) :
+                      i % 3 == 1 ? std::to_string(i) + ".5" :
+                      '"' + std::to_string(i) + '"') + ' ';
+        return (s + ')');
+}
+
+// The peak resident set size of the process, in kilobytes.
+long PeakRss()
+{
+        struct rusage usage;
+
+        if (getrusage(RUSAGE_SELF, &usage) != 0)
+                return (0);
+#ifdef __APPLE__
+        return (usage.ru_maxrss / 1024);
+#else
+        return (usage.ru_maxrss);
+#endif
+}
+
+// Runs the workloads, each in an interpreter of its own, and prints on os
+// in JSON the time and the objects allocated per operation, and the peak
+// resident set size of the process once the workload has run.
+void RunBenchmarks(Engine engine, std::ostream& os)
+{
+        static const string kLists =
+                "(define build (n acc) (if (< n 1) acc "
+                "(build (- n 1) (cons n acc))))"
+                "(define rev (l acc) (if (nil? l) acc "
+                "(rev (cdr l) (cons (car l) acc))))";
+        const vector<Workload> workloads = {
+                {"fib", Workload::Eval,
+                 "(define fib (n) (if (< n 2) n "
+                 "(+ (fib (- n 1)) (fib (- n 2)))))",
+                 "(fib 20)", 50},
+                {"tak", Workload::Eval,
+                 "(define tak (x y z) (if (< y x) "
+                 "(tak (tak (- x 1) y z) (tak (- y 1) z x) "
+                 "(tak (- z 1) x y)) z))",
+                 "(tak 18 12 6)", 10},
+                {"ackermann", Workload::Eval,
+                 "(define ack (m n) (if (= m 0) (+ n 1) "
+                 "(if (= n 0) (ack (- m 1) 1) "
+                 "(ack (- m 1) (ack m (- n 1))))))",
+                 "(ack 3 5)", 20},
+                {"list-build-reverse", Workload::Eval, kLists,
+                 "(car (rev (build 10000 '()) '()))", 100},
+                {"deep-recursion", Workload::Eval,
+                 "(define deep (n) (if (< n 1) 0 (+ 1 (deep (- n 1)))))",
+                 "(deep 10000)", 100},
+                {"pmapcar", Workload::Eval,
+                 "(define fib (n) (if (< n 2) n "
+                 "(+ (fib (- n 1)) (fib (- n 2)))))",
+                 "(pmapcar fib '(18 18 18 18 18 18 18 18 18 18 18 18 18 "
+                 "18 18 18))", 20},
+                {"parse-symbols", Workload::Read, "", SymbolsText(10000),
+                 50},
+                {"parse-literal", Workload::Read, "", LiteralText(10000),
+                 50},
+                {"print", Workload::Eval,
+                 kLists + "(set data (build 10000 '()))", "data", 100},
+        };
+        std::ostream discard(NULL);
+
+        os << "{\n  \"engine\": \"" <<
+                (engine == Engine::Tree ? "tree" : "bytecode") <<
+                "\",\n  \"threads\": " <<
+                ThreadPool::GetInstance().Threads() <<
+                ",\n  \"workloads\": [";
+        for (size_t i = 0; i < workloads.size(); i++) {
+                auto& w = workloads[i];
+                SimpleLispInterpreter interp(engine);
+
+                interp.Process(w.setup, discard);
+                auto& heap = Heap::GetInstance();
+                // The first operation warms up, and is not measured.
+                auto run = [&w, &interp, &discard]() {
+                        if (w.kind == Workload::Eval) {
+                                interp.Process(w.input, discard);
+                                return;
+                        }
+                        std::istringstream is(w.input);
+                        Reader reader(is);
+                        Value e;
+                        while (reader.Read(e))
+                                ;
+                        Heap::GetInstance().MaybeCollect();
+                };
+                run();
+                size_t allocations = heap.Allocations();
+                auto start = std::chrono::steady_clock::now();
+                for (size_t k = 0; k < w.ops; k++)
+                        run();
+                std::chrono::duration<double, std::nano> elapsed =
+                        std::chrono::steady_clock::now() - start;
+
+                os << (i ? "," : "") << "\n    {\"name\": \"" << w.name <<
+                        "\", \"ops\": " << w.ops << std::fixed <<
+                        std::setprecision(1) << ", \"ns_per_op\": " <<
+                        elapsed.count() / w.ops << ", \"allocs_per_op\": " <<
+                        static_cast<double>(heap.Allocations() -
+                                            allocations) / w.ops <<
+                        ", \"peak_rss_kb\": " << PeakRss() << '}';
+                os.unsetf(std::ios::fixed);
+        }
+        os << "\n  ]\n}" << std::endl;
+}
+
+// Evaluates the requests of clients connected to a Unix domain socket, or
+// to a TCP port of the loopback interface.  A request is a line of forms,
+// and its answer the value of each form on a line of its own, or the error
+// that stopped it, followed by an empty line.  A client may send requests
+// without waiting for the answers, they are processed in order.
+//
+// Each thread of the server serves a connection at a time, in an
+// interpreter of its own that starts from a copy of the global bindings of
+// one built, and set up, when the thread starts.  The definitions of a
+// connection last as long as it does.
+class Server {
+public:
+        typedef std::function<void(SimpleLispInterpreter&)> Setup;
+
+        explicit Server(Server const&)          = delete;
+        void operator=(Server const&)           = delete;
+
+        // An address made of digits only is a port, a path otherwise.
+        explicit Server(Engine engine, const string& address,
+                        const Setup& setup) :
+                engine_(engine), setup_(setup), fd_(-1)
+        {
+                if (address.find_first_not_of("0123456789") ==
+                    string::npos) {
+                        struct sockaddr_in in;
+                        int on = 1;
+
+                        std::memset(&in, 0, sizeof(in));
+                        in.sin_family = AF_INET;
+                        in.sin_port = htons(std::stoi(address));
+                        in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+                        fd_ = socket(AF_INET, SOCK_STREAM, 0);
+                        if (fd_ >= 0)
+                                setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR,
+                                           &on, sizeof(on));
+                        Listen(address,
+                               reinterpret_cast<struct sockaddr *>(&in),
+                               sizeof(in));
+                } else {
+                        struct sockaddr_un un;
+                        struct stat st;
+
+                        if (address.size() >= sizeof(un.sun_path))
+                                throw LispException(address +
+                                                    ": Path too long.");
+                        std::memset(&un, 0, sizeof(un));
+                        un.sun_family = AF_UNIX;
+                        std::strcpy(un.sun_path, address.c_str());
+                        // A socket left by an earlier server is replaced.
+                        if (stat(address.c_str(), &st) == 0 &&
+                            S_ISSOCK(st.st_mode))
+                                unlink(address.c_str());
+                        fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+                        Listen(address,
+                               reinterpret_cast<struct sockaddr *>(&un),
+                               sizeof(un));
+                }
+        }
+
+        ~Server() { close(fd_); }
+
+        // Serves with n threads, forever.
+        void Run(size_t n)
+        {
+                vector<std::thread> threads;
+
+                // A client gone is noticed by the failed writes.
+                signal(SIGPIPE, SIG_IGN);
+                for (size_t i = 0; i < n; i++)
+                        threads.emplace_back(&Server::Work, this);
+                for (auto& t: threads)
+                        t.join();
+        }
+private:
+        void Listen(const string& address, const struct sockaddr *sa,
+                    socklen_t size)
+        {
+                if (fd_ < 0 || bind(fd_, sa, size) != 0 ||
+                    listen(fd_, SOMAXCONN) != 0)
+                        throw LispException(address + ": " +
+                                            std::strerror(errno));
+        }
+
+        void Work()
+        {
+                SimpleLispInterpreter base(engine_);
+
+                try {
+                        setup_(base);
+                } catch (const std::exception &e) {
+                        std::cerr << "Error: " << e.what() << std::endl;
+                        return;
+                }
+                for (;;) {
+                        int fd = accept(fd_, NULL, NULL);
+                        if (fd < 0) {
+                                if (errno == EINTR || errno == ECONNABORTED)
+                                        continue;
+                                std::cerr << "accept: " <<
+                                        std::strerror(errno) << std::endl;
+                                return;
+                        }
+                        Serve(base, fd);
+                        close(fd);
+                }
+        }
+
+        void Serve(const SimpleLispInterpreter& base, int fd)
+        {
+                SimpleLispInterpreter interp(base);
+                FdBuf buf(fd);
+                std::istream is(&buf);
+                std::ostream os(&buf);
+                Reader reader(is);
+
+                for (;;) {
+                        try {
+                                if (!interp.Process(reader, os))
+                                        break;
+                                if (!reader.AtLineEnd())
+                                        continue;
+                        } catch (const std::exception &e) {
+                                os << "Error: " << e.what() << '\n';
+                                reader.Discard();
+                        }
+                        os << '\n';
+                        if (!os)
+                                break;
+                }
+        }
+
+        const Engine engine_;
+        const Setup setup_;
+        int fd_;
+};
+
+// Whether command is !stress [n], 16 interpreters by default.
+bool IsStress(const string& command, size_t& n)
+{
+        std::istringstream is(command);
+        string word;
+
+        if (!(is >> word) || word != "!stress")
+                return (false);
+        n = 16;
+        if (!(is >> word))
+                return (true);
+        if (word.find_first_not_of("0123456789") != string::npos ||
+            (n = std::stoul(word)) == 0 || is >> word)
+                throw LispException("Usage: !stress [n]");
+        return (true);
+}
+
 } // namespace
 
 int
-main(void)
+main(int argc, char *argv[])
 {
-        SimpleLispInterpreter lisp_interpreter;
-        string user_input;
+        auto engine = Engine::Bytecode;
+        vector<string> libs;
+        vector<string> preludes;
+        string source;
+        string address;
+        string image;
+        string dump;
+        bool bench = false;
+        // The interpreters to run the tests in at once, if any.
+        size_t stress = 0;
+        // The test file to run, and the timings to compare with and to
+        // save.
+        string tests;
+        string baseline;
+        string save;
+
+        for (int i = 1; i < argc; i++) {
+                string arg = argv[i];
+                if (arg == "-t") {
+                        engine = Engine::Tree;
+                        continue;
+                }
+                if (arg == "-h") {
+                        HashCons::Enable();
+                        continue;
+                }
+                if (arg == "-b") {
+                        bench = true;
+                        continue;
+                }
+                if (arg == "-j" && i + 1 < argc && std::atoi(argv[i + 1]) > 0) {
+                        ThreadPool::SetThreads(std::atoi(argv[++i]));
+                        continue;
+                }
+                if (arg == "-S" && i + 1 < argc && std::atoi(argv[i + 1]) > 0) {
+                        stress = std::atoi(argv[++i]);
+                        continue;
+                }
+                if (arg == "-s" && i + 1 < argc) {
+                        address = argv[++i];
+                        continue;
+                }
+                if (arg == "-p" && i + 1 < argc) {
+                        preludes.push_back(argv[++i]);
+                        continue;
+                }
+                if ((arg == "-i" || arg == "-o") && i + 1 < argc) {
+                        (arg == "-i" ? image : dump) = argv[++i];
+                        continue;
+                }
+                if ((arg == "-r" || arg == "-B" || arg == "-w") &&
+                    i + 1 < argc) {
+                        (arg == "-r" ? tests : arg == "-B" ? baseline :
+                         save) = argv[++i];
+                        continue;
+                }
+                if ((arg == "-l" || arg == "-c") && i + 1 < argc) {
+                        if (arg == "-l")
+                                libs.push_back(argv[++i]);
+                        else
+                                source = argv[++i];
+                        continue;
+                }
+                std::cerr << "usage: " << argv[0] <<
+                        " [-t] [-h] [-j threads] [-i image] [-l library]..." <<
+                        " [-p prelude]... [-o image | -s address] | -c file" <<
+                        " | -b | -r tests [-B timings] [-w timings]" <<
+                        " | -S interpreters" <<
+                        std::endl;
+                return (1);
+        }
 
-        std::cerr << "Enter an expression (or '!exit' to quit and " <<
-                "'!test' to run tests):" << std::endl;
-        for (;;) {
-                std::cerr << "> ";
-                getline(std::cin, user_input);
-                if (user_input == "!exit")
-                        break;
-                if (user_input == "!test") {
-                        RunTests();
-                        continue;                        
+        // Starts an interpreter from the image, then the libraries and the
+        // preludes.
+        auto setup = [&image, &libs, &preludes](
+                             SimpleLispInterpreter& interp) {
+                if (!image.empty())
+                        interp.Restore(image);
+                for (auto& lib: libs)
+                        interp.Load(lib);
+                for (auto& prelude: preludes)
+                        interp.Source(prelude);
+        };
+
+        SimpleLispInterpreter lisp_interpreter(engine);
+        FdBuf input(STDIN_FILENO);
+        std::istream is(&input);
+        Reader reader(is, &std::cerr);
+        string command;
+        size_t n;
+
+        try {
+                if (!source.empty()) {
+                        lisp_interpreter.Translate(source, std::cout);
+                        return (0);
+                }
+                if (bench) {
+                        RunBenchmarks(engine, std::cout);
+                        return (0);
+                }
+                if (stress != 0)
+                        return (StressTests(engine, stress) == 0 ? 0 : 1);
+                if (!tests.empty())
+                        return (RunConformance(engine, tests, setup,
+                                               baseline, save));
+                if (!address.empty()) {
+                        // The libraries keep the values they refer to in
+                        // the heap of the interpreter that loaded them.
+                        if (!libs.empty())
+                                throw LispException(
+                                        "Libraries can't be served.");
+                        // The errors of the setup show up here first.
+                        setup(lisp_interpreter);
+                        Server server(engine, address, setup);
+                        server.Run(ThreadPool::GetInstance().Threads());
+                        return (0);
                 }
+                setup(lisp_interpreter);
+                if (!dump.empty()) {
+                        lisp_interpreter.Dump(dump);
+                        return (0);
+                }
+        } catch (const std::exception &e) {
+                std::cerr << "Error: " << e.what() << std::endl;
+                return (1);
+        }
+
+        std::cerr << "Enter an expression (or '!exit' to quit, " <<
+                "'!test' to run tests, '!stress [n]' to run them in n " <<
+                "interpreters at once, '!profile' to start or stop " <<
+                "profiling and '!stats' to print the counters of the " <<
+                "interpreter):" << std::endl;
+        for (;;) {
                 try {
-                        lisp_interpreter.Process(user_input);
+                        if (!reader.Command(command)) {
+                                if (!lisp_interpreter.Process(reader))
+                                        break;
+                                continue;
+                        }
+                        if (command == "!exit")
+                                break;
+                        if (command == "!test")
+                                RunTests(engine);
+                        else if (command == "!profile" &&
+                                 !lisp_interpreter.Profiling())
+                                lisp_interpreter.StartProfiling();
+                        else if (command == "!profile")
+                                lisp_interpreter.StopProfiling(std::cerr,
+                                                               kFoldedStacks);
+                        else if (command == "!stats")
+                                lisp_interpreter.ReportStats(std::cerr);
+                        else if (IsStress(command, n))
+                                StressTests(engine, n);
+                        else
+                                throw LispException("Unknown command: " +
+                                                    command);
                 } catch (const std::exception &e) {
                         std::cerr << "Error: " << e.what() << std::endl;
+                        reader.Discard();
                 }
         }
 
@@ -0,0 +1,318 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <netinet/in.h>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Drives a server started with "output -s address": each connection sends
+// the same request again and again, keeping up to depth of them in flight,
+// and the time from sending a request to reading its answer is measured.
+// Exits with 1 if an answer was an error, or not the one expected.
+
+namespace {
+
+using std::string;
+using std::vector;
+
+typedef std::chrono::steady_clock Clock;
+
+struct Options {
+        Options() : connections(4), requests(10000), depth(8),
+                    request("(car '(1 2 3))")
+        {}
+
+        string address;
+        size_t connections;
+        // Per connection.
+        size_t requests;
+        size_t depth;
+        // Sent once per connection, before the requests measured.
+        vector<string> setup;
+        string request;
+        // The lines of the answer to the request, unless empty.
+        vector<string> expected;
+};
+
+// What a connection measured.
+struct Results {
+        Results() : errors(0) {}
+
+        vector<double> latencies;
+        size_t errors;
+};
+
+// An address made of digits only is a port of the loopback interface, a
+// path otherwise, as for the server.
+int Connect(const string& address)
+{
+        int fd;
+        int r;
+
+        if (address.find_first_not_of("0123456789") == string::npos) {
+                struct sockaddr_in in;
+
+                std::memset(&in, 0, sizeof(in));
+                in.sin_family = AF_INET;
+                in.sin_port = htons(std::stoi(address));
+                in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+                fd = socket(AF_INET, SOCK_STREAM, 0);
+                r = fd < 0 ? -1 : connect(fd,
+                        reinterpret_cast<struct sockaddr *>(&in), sizeof(in));
+        } else {
+                struct sockaddr_un un;
+
+                if (address.size() >= sizeof(un.sun_path))
+                        throw std::runtime_error(address + ": Path too long.");
+                std::memset(&un, 0, sizeof(un));
+                un.sun_family = AF_UNIX;
+                std::strcpy(un.sun_path, address.c_str());
+                fd = socket(AF_UNIX, SOCK_STREAM, 0);
+                r = fd < 0 ? -1 : connect(fd,
+                        reinterpret_cast<struct sockaddr *>(&un), sizeof(un));
+        }
+        if (r != 0) {
+                string error = address + ": " + std::strerror(errno);
+                if (fd >= 0)
+                        close(fd);
+                throw std::runtime_error(error);
+        }
+        return (fd);
+}
+
+void WriteAll(int fd, const string& s)
+{
+        const char *p = s.data();
+        const char *end = p + s.size();
+
+        while (p < end) {
+                ssize_t n = write(fd, p, end - p);
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n < 0)
+                        throw std::runtime_error(std::strerror(errno));
+                p += n;
+        }
+}
+
+// Splits the bytes read into answers, each ended by an empty line.
+class Answers {
+public:
+        explicit Answers(int fd, const vector<string>& expected) :
+                fd_(fd), expected_(expected), error_(false)
+        {}
+
+        // Reads until at least one more answer is complete.  Returns the
+        // number completed, and counts those that are errors, or not the
+        // expected ones, in errors.
+        size_t Read(size_t& errors)
+        {
+                size_t done = 0;
+
+                while (done == 0) {
+                        ssize_t n = read(fd_, buf_, sizeof(buf_));
+                        if (n < 0 && errno == EINTR)
+                                continue;
+                        if (n < 0)
+                                throw std::runtime_error(
+                                        std::strerror(errno));
+                        if (n == 0)
+                                throw std::runtime_error(
+                                        "Connection closed by the server.");
+                        for (ssize_t i = 0; i < n; i++)
+                                done += Scan(buf_[i], errors);
+                }
+                return (done);
+        }
+private:
+        size_t Scan(char c, size_t& errors)
+        {
+                static const string kError = "Error: ";
+
+                if (c != '\n') {
+                        if (line_.size() < kError.size() ||
+                            !expected_.empty())
+                                line_ += c;
+                        return (0);
+                }
+                if (!line_.empty()) {
+                        // No value prints as an error does.
+                        if (line_.compare(0, kError.size(), kError) == 0)
+                                error_ = true;
+                        if (!expected_.empty())
+                                answer_.push_back(line_);
+                        line_.clear();
+                        return (0);
+                }
+                errors += error_ || answer_ != expected_;
+                error_ = false;
+                answer_.clear();
+                return (1);
+        }
+
+        const int fd_;
+        const vector<string>& expected_;
+        // The line being read, only its start unless an answer is
+        // expected.
+        string line_;
+        vector<string> answer_;
+        // Whether a line of the answer is an error.
+        bool error_;
+        char buf_[4096];
+};
+
+void Drive(const Options& options, Results& results)
+{
+        int fd = Connect(options.address);
+        Answers answers(fd, options.expected);
+        size_t ignored = 0;
+
+        for (auto& line: options.setup) {
+                WriteAll(fd, line + '\n');
+                answers.Read(ignored);
+        }
+
+        std::deque<Clock::time_point> sent;
+        string batch;
+        size_t received = 0;
+        size_t queued = 0;
+        while (received < options.requests) {
+                batch.clear();
+                while (queued < options.requests &&
+                       queued - received < options.depth) {
+                        batch += options.request;
+                        batch += '\n';
+                        queued++;
+                }
+                auto now = Clock::now();
+                WriteAll(fd, batch);
+                sent.insert(sent.end(), queued - received - sent.size(),
+                            now);
+
+                size_t n = answers.Read(results.errors);
+                now = Clock::now();
+                for (size_t i = 0; i < n; i++) {
+                        std::chrono::duration<double, std::micro> d =
+                                now - sent.front();
+                        results.latencies.push_back(d.count());
+                        sent.pop_front();
+                }
+                received += n;
+        }
+        close(fd);
+}
+
+double Percentile(const vector<double>& sorted, double p)
+{
+
+        if (sorted.empty())
+                return (0);
+        size_t i = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+        return (sorted[i]);
+}
+
+bool ParseCount(const char *s, size_t& n)
+{
+        char *end;
+
+        errno = 0;
+        n = std::strtoul(s, &end, 10);
+        return (*s != '\0' && *end == '\0' && errno == 0 && n > 0);
+}
+
+} // namespace
+
+int
+main(int argc, char *argv[])
+{
+        Options options;
+
+        for (int i = 1; i < argc; i++) {
+                string arg = argv[i];
+                bool ok = i + 1 < argc;
+                if (ok && arg == "-c")
+                        ok = ParseCount(argv[++i], options.connections);
+                else if (ok && arg == "-n")
+                        ok = ParseCount(argv[++i], options.requests);
+                else if (ok && arg == "-d")
+                        ok = ParseCount(argv[++i], options.depth);
+                else if (ok && arg == "-s")
+                        options.setup.push_back(argv[++i]);
+                else if (ok && arg == "-e")
+                        options.request = argv[++i];
+                else if (ok && arg == "-x")
+                        options.expected.push_back(argv[++i]);
+                else if (options.address.empty() && arg[0] != '-') {
+                        options.address = arg;
+                        ok = true;
+                }
+                else
+                        ok = false;
+                if (!ok) {
+                        options.address.clear();
+                        break;
+                }
+        }
+        if (options.address.empty()) {
+                std::cerr << "usage: " << argv[0] << " [-c connections]" <<
+                        " [-n requests] [-d depth] [-s setup]..." <<
+                        " [-e request] [-x line]... address" << std::endl;
+                return (1);
+        }
+
+        vector<Results> results(options.connections);
+        vector<std::thread> threads;
+        std::mutex lock;
+        string error;
+        auto start = Clock::now();
+        for (size_t i = 0; i < options.connections; i++)
+                threads.emplace_back([&options, &results, &lock, &error,
+                                      i]() {
+                        try {
+                                Drive(options, results[i]);
+                        } catch (const std::exception& e) {
+                                std::lock_guard<std::mutex> guard(lock);
+                                error = e.what();
+                        }
+                });
+        for (auto& t: threads)
+                t.join();
+        std::chrono::duration<double> elapsed = Clock::now() - start;
+
+        if (!error.empty()) {
+                std::cerr << "Error: " << error << std::endl;
+                return (1);
+        }
+
+        vector<double> latencies;
+        size_t errors = 0;
+        for (auto& r: results) {
+                latencies.insert(latencies.end(), r.latencies.begin(),
+                                 r.latencies.end());
+                errors += r.errors;
+        }
+        std::sort(latencies.begin(), latencies.end());
+
+        std::cout << std::fixed << std::setprecision(1) <<
+                "requests:    " << latencies.size() << " (" <<
+                options.connections << " connections, depth " <<
+                options.depth << ", " << errors << " errors)\n" <<
+                "throughput:  " << latencies.size() / elapsed.count() <<
+                " requests/s\n" <<
+                "latency p50: " << Percentile(latencies, 0.50) << " us\n" <<
+                "latency p99: " << Percentile(latencies, 0.99) << " us" <<
+                std::endl;
+        return (errors == 0 ? 0 : 1);
+}
@@ -0,0 +1,4 @@
+(define quoted (x) '(1 -2 (3 4) 2.5))
+(define nested (x) (cons x '((1) 2)))
+(define fold (f l x) (cons (cons x x) (preduce f l 0)))
+(define each (f tb x) (cons (cons x x) (hash-for-each f tb)))
@@ -0,0 +1,11 @@
+(define span (x)
+  (cons x
+        '(1
+          2)))
+(set a 1) (set b
+ 2)
+(set text "one
+two")
+(set
+ deep '((((
+   ((5)) )))))